@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "arena.h"
+#include "log.h"
+
+#define ALIGN(n)	(((n) + 15) & ~((size_t)15))
+
+struct arena *be_arena = NULL;
+
+static struct arena_block *block_new(size_t size)
+{
+	struct arena_block *b;
+
+	if ((b = malloc(sizeof(struct arena_block) + size)) == NULL)
+		return (NULL);
+	b->next = NULL;
+	b->size = size;
+	b->used = 0;
+	return (b);
+}
+
+struct arena *arena_new(size_t blocksize)
+{
+	struct arena *a;
+
+	if ((a = malloc(sizeof(struct arena))) == NULL)
+		return (NULL);
+	a->blocksize = ALIGN(blocksize);
+	a->nallocs = 0;
+	a->nblocks = 0;
+	if ((a->head = block_new(a->blocksize)) == NULL) {
+		free(a);
+		return (NULL);
+	}
+	return (a);
+}
+
+void arena_free(struct arena *a)
+{
+	struct arena_block *b, *next;
+
+	if (a == NULL)
+		return;
+	for (b = a->head; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+	free(a);
+}
+
+/*
+ * Release everything allocated since the last reset. If the call needed
+ * more than the base block, the base block is regrown to the total so
+ * that the next call of the same shape allocates nothing.
+ */
+
+void arena_reset(struct arena *a)
+{
+	struct arena_block *b, *next;
+	size_t total = 0;
+
+	if (a == NULL)
+		return;
+
+	if (a->nallocs)
+		_log(LOG_DEBUG, "arena: %lu allocations, %lu extra blocks", a->nallocs, a->nblocks);
+
+	if (a->head->next != NULL) {
+		for (b = a->head; b != NULL; b = next) {
+			next = b->next;
+			total += b->used;
+			free(b);
+		}
+		if (ALIGN(total) > a->blocksize)
+			a->blocksize = ALIGN(total);
+		if ((a->head = block_new(a->blocksize)) == NULL)
+			_fatal("ENOMEM");
+	}
+	a->head->used = 0;
+	a->nallocs = 0;
+	a->nblocks = 0;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_block *b;
+	void *p;
+
+	size = ALIGN(size);
+	if (a->head->used + size > a->head->size) {
+		if ((b = block_new(size > a->blocksize ? size : a->blocksize)) == NULL)
+			return (NULL);
+		b->next = a->head;
+		a->head = b;
+		a->nblocks++;
+	}
+	p = a->head->data + a->head->used;
+	a->head->used += size;
+	a->nallocs++;
+	return (p);
+}
+
+char *arena_strdup(struct arena *a, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	if ((p = arena_alloc(a, len)) != NULL)
+		memcpy(p, s, len);
+	return (p);
+}
+
+char *arena_sprintf(struct arena *a, const char *fmt, ...)
+{
+	va_list va;
+	int len;
+	char *p;
+
+	va_start(va, fmt);
+	len = vsnprintf(NULL, 0, fmt, va);
+	va_end(va);
+	if (len < 0)
+		return (NULL);
+
+	if ((p = arena_alloc(a, len + 1)) == NULL)
+		return (NULL);
+
+	va_start(va, fmt);
+	vsnprintf(p, len + 1, fmt, va);
+	va_end(va);
+	return (p);
+}
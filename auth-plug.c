@@ -49,6 +49,14 @@
 # define mosquitto_auth_opt mosquitto_opt
 #endif
 
+/*
+ * Since mosquitto 1.5 (auth plugin version 3) SUBSCRIBE is checked
+ * separately, and READ is checked on every message delivered.
+ */
+#if MOSQ_AUTH_PLUGIN_VERSION >= 3 && defined(MOSQ_ACL_SUBSCRIBE)
+# define PROVEN_FILTERS
+#endif
+
 #include "log.h"
 #include "hash.h"
 #include "backends.h"
@@ -69,6 +77,8 @@
 
 #include "userdata.h"
 #include "cache.h"
+#include "arena.h"
+#include "rcu.h"
 
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
@@ -81,6 +91,8 @@
 				(*pskbep)->conf =  (*bep)->conf; \
 				(*pskbep)->superuser =  (*bep)->superuser; \
 				(*pskbep)->aclcheck =  (*bep)->aclcheck; \
+				(*pskbep)->aclcheck_rule =  (*bep)->aclcheck_rule; \
+				(*pskbep)->superacl =  (*bep)->superacl; \
 			} \
 		   } while (0)
 #else
@@ -92,11 +104,33 @@ struct backend_p {
 	char *name;
 	f_kill *kill;
 	f_getuser *getuser;
+	f_getuser_ref *getuser_ref;	/* optional */
 	f_superuser *superuser;
 	f_aclcheck *aclcheck;
+	f_aclcheck_rule *aclcheck_rule;	/* optional */
+	f_superacl *superacl;		/* optional */
+};
+
+/* ACL result a back-end's ->superacl() returned with its superuser check */
+struct prefetch {
+	bool done;
+	int match;
+	char *rule;
 };
 
 int pbkdf2_check(char *password, char *hash);
+int pbkdf2_check_len(const char *password, const char *hash, size_t hashlen);
+
+/*
+ * Start of every plugin call: free data retired by back-end threads and
+ * apply the cache invalidations they asked for.
+ */
+
+static void call_begin(struct userdata *ud)
+{
+	rcu_quiescent();
+	cache_invalidate_drain(ud);
+}
 
 int mosquitto_auth_plugin_version(void)
 {
@@ -140,8 +174,14 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 	ud->acl_cachejitter = 0;
 	ud->auth_cachejitter = 0;
 	ud->aclcache = NULL;
+	ud->rulecache = NULL;
 	ud->authcache = NULL;
 	ud->clients = NULL;
+	if ((ud->arena = arena_new(4096)) == NULL) {
+		perror("allocating arena");
+		return MOSQ_ERR_UNKNOWN;
+	}
+	be_arena = ud->arena;
 
 	/*
 	 * Shove all options Mosquitto gives the plugin into a hash,
@@ -239,6 +279,9 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			(*bep)->getuser =  be_mysql_getuser;
 			(*bep)->superuser =  be_mysql_superuser;
 			(*bep)->aclcheck =  be_mysql_aclcheck;
+			(*bep)->aclcheck_rule =  be_mysql_aclcheck_rule;
+			if (be_mysql_nonblocking((*bep)->conf))
+				(*bep)->superacl =  be_mysql_superacl;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -258,6 +301,8 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			(*bep)->getuser = be_pg_getuser;
 			(*bep)->superuser = be_pg_superuser;
 			(*bep)->aclcheck = be_pg_aclcheck;
+			(*bep)->aclcheck_rule = be_pg_aclcheck_rule;
+			(*bep)->superacl = be_pg_superacl;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -294,8 +339,10 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			}
 			(*bep)->kill =  be_cdb_destroy;
 			(*bep)->getuser =  be_cdb_getuser;
+			(*bep)->getuser_ref =  be_cdb_getuser_ref;
 			(*bep)->superuser =  be_cdb_superuser;
 			(*bep)->aclcheck =  be_cdb_aclcheck;
+			(*bep)->aclcheck_rule =  be_cdb_aclcheck_rule;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -315,6 +362,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			(*bep)->getuser =  be_sqlite_getuser;
 			(*bep)->superuser =  be_sqlite_superuser;
 			(*bep)->aclcheck =  be_sqlite_aclcheck;
+			(*bep)->aclcheck_rule =  be_sqlite_aclcheck_rule;
 			found = 1;
 			ud->fallback_be = ud->fallback_be == -1 ? nord : ud->fallback_be;
 			PSKSETUP;
@@ -428,6 +476,7 @@ int mosquitto_auth_plugin_init(void **userdata, struct mosquitto_auth_opt *auth_
 			(*bep)->getuser =  be_files_getuser;
 			(*bep)->superuser =  be_files_superuser;
 			(*bep)->aclcheck =  be_files_aclcheck;
+			(*bep)->aclcheck_rule =  be_files_aclcheck_rule;
 			found = 1;
 			PSKSETUP;
 		}
@@ -462,6 +511,15 @@ int mosquitto_auth_plugin_cleanup(void *userdata, struct mosquitto_auth_opt *aut
 		}
 	}
 
+	if (ud->rulecache != NULL) {
+		struct rulecacheentry *r, *tmp;
+
+		HASH_ITER(hh, ud->rulecache, r, tmp) {
+			HASH_DEL(ud->rulecache, r);
+			acl_cache_rule_free(r);
+		}
+	}
+
 	if (ud->authcache != NULL) {
 		struct cacheentry *a, *tmp;
 
@@ -482,6 +540,12 @@ int mosquitto_auth_plugin_cleanup(void *userdata, struct mosquitto_auth_opt *aut
 		free(ud->be_list);
 	}
 
+	/* back-end threads are gone: release what they left behind */
+	call_begin(ud);
+
+	be_arena = NULL;
+	arena_free(ud->arena);
+
 	free(ud);
 
 	return MOSQ_ERR_SUCCESS;
@@ -509,6 +573,8 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 	char *phash = NULL, *backend_name = NULL;
 	int match, authenticated = FALSE, nord, granted, rc, has_error = FALSE;
 
+	call_begin(ud);
+
 	if (!username || !*username || !password || !*password)
 		return MOSQ_DENY_AUTH;
 
@@ -520,6 +586,7 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 	if (e) {
 		free(e->username);
 		free(e->clientid);
+		proven_free(e);
 		e->username = strdup(username);
 		e->clientid = strdup("client id not available");
 	} else {
@@ -527,6 +594,8 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 		e->key = (void *)client;
 		e->username = strdup(username);
 		e->clientid = strdup("client id not available");
+		e->proven = NULL;
+		e->nproven = 0;
 		HASH_ADD(hh, ud->clients, key, sizeof(void *), e);
 	}
 #endif
@@ -535,6 +604,7 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 	if (granted != MOSQ_ERR_UNKNOWN) {
 		_log(LOG_DEBUG, "getuser(%s) CACHEDAUTH: %d",
 			username, (granted == MOSQ_ERR_SUCCESS) ? TRUE : FALSE);
+		arena_reset(ud->arena);
 		return granted;
 	}
 
@@ -552,11 +622,28 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 			free(phash);
 			phash = NULL;
 		}
+		if (b->getuser_ref) {
+			const char *ref = NULL;
+			size_t reflen = 0;
+
+#if MOSQ_AUTH_PLUGIN_VERSION >=3
+			rc = b->getuser_ref(b->conf, username, password, &ref, &reflen, mosquitto_client_id(client));
+#else
+			rc = b->getuser_ref(b->conf, username, password, &ref, &reflen, NULL);
+#endif
+			if (rc == BACKEND_DEFER && ref != NULL &&
+			    pbkdf2_check_len(password, ref, reflen) == 1) {
+				backend_name = (*bep)->name;
+				authenticated = TRUE;
+				break;
+			}
+		} else {
 #if MOSQ_AUTH_PLUGIN_VERSION >=3	
-		rc = b->getuser(b->conf, username, password, &phash, mosquitto_client_id(client));
+			rc = b->getuser(b->conf, username, password, &phash, mosquitto_client_id(client));
 #else
-		rc = b->getuser(b->conf, username, password, &phash, NULL);
+			rc = b->getuser(b->conf, username, password, &phash, NULL);
 #endif
+		}
 		if (rc == BACKEND_ALLOW) {
 			backend_name = (*bep)->name;
 			authenticated = TRUE;
@@ -594,9 +681,94 @@ int mosquitto_auth_unpwd_check(void *userdata, const char *username, const char
 		granted = MOSQ_ERR_UNKNOWN;
 	}
 	auth_cache(username, password, granted, userdata);
+	arena_reset(ud->arena);
 	return granted;
 }
 
+#ifdef PROVEN_FILTERS
+/*
+ * Is `topic' matched by a filter on which READ was proven for this client?
+ */
+
+static int proven_q(struct cliententry *e, const char *topic)
+{
+	struct provenfilter **pfp, *pf;
+	time_t now = time(NULL);
+	bool bf;
+
+	for (pfp = &e->proven; (pf = *pfp) != NULL; ) {
+		if (now > pf->expire_time) {
+			*pfp = pf->next;
+			free(pf->filter);
+			free(pf);
+			e->nproven--;
+			continue;
+		}
+		if (t_matches(pf->filter, topic, &bf) == MOSQ_ERR_SUCCESS && bf)
+			return (TRUE);
+		pfp = &pf->next;
+	}
+	return (FALSE);
+}
+
+/*
+ * The client was granted SUBSCRIBE on `filter'. Try to prove that the
+ * user's rules also grant READ on every topic the filter can match, i.e.
+ * the user is a superuser or the first back-end with an opinion grants
+ * READ on the filter as a whole. A back-end without ->aclcheck_rule()
+ * may decide per topic, so reaching one ends the attempt.
+ */
+
+static void proven_add(struct userdata *ud, struct cliententry *e, const char *clientid, const char *username, const char *filter)
+{
+	struct backend_p **bep;
+	struct provenfilter *pf;
+	int proven = FALSE, match;
+
+	if (ud->acl_cacheseconds <= 0 || e->nproven >= MAXPROVEN)
+		return;
+
+	for (pf = e->proven; pf != NULL; pf = pf->next) {
+		if (strcmp(pf->filter, filter) == 0)
+			return;
+	}
+
+	if (ud->superusers && fnmatch(ud->superusers, username, 0) == 0)
+		proven = TRUE;
+
+	for (bep = ud->be_list; !proven && bep && *bep; bep++) {
+		match = (*bep)->superuser((*bep)->conf, username);
+		if (match == BACKEND_ALLOW)
+			proven = TRUE;
+		else if (match != BACKEND_DEFER)
+			return;
+	}
+
+	for (bep = ud->be_list; !proven && bep && *bep; bep++) {
+		struct backend_p *b = *bep;
+
+		if (b->aclcheck_rule == NULL)
+			return;
+		match = b->aclcheck_rule(b->conf, clientid, username, filter, MOSQ_ACL_READ, NULL);
+		if (match == BACKEND_ALLOW)
+			proven = TRUE;
+		else if (match != BACKEND_DEFER)
+			return;
+	}
+
+	if (!proven)
+		return;
+
+	pf = (struct provenfilter *)malloc(sizeof(struct provenfilter));
+	pf->filter = strdup(filter);
+	pf->expire_time = time(NULL) + ud->acl_cacheseconds;
+	pf->next = e->proven;
+	e->proven = pf;
+	e->nproven++;
+	_log(LOG_DEBUG, "aclcheck(%s, %s) READ proven for filter", username, filter);
+}
+#endif /* PROVEN_FILTERS */
+
 #if MOSQ_AUTH_PLUGIN_VERSION >= 3
 int mosquitto_auth_acl_check(void *userdata, int access, struct mosquitto *client, const struct mosquitto_acl_msg *msg)
 #else
@@ -606,15 +778,24 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 	struct userdata *ud = (struct userdata *)userdata;
 	struct backend_p **bep;
 	char *backend_name = NULL;
-	int match = 0, authorized = FALSE, has_error = FALSE;
+	int match = 0, authorized = FALSE, has_error = FALSE, n;
 	int granted = MOSQ_DENY_ACL;
+	bool rules_only = true;
+	struct prefetch pre[NBACKENDS];
 #if MOSQ_AUTH_PLUGIN_VERSION >= 3
 	struct cliententry *e;
 	const char *clientid = NULL;
 	const char *username = NULL;
 	const char *topic = msg->topic;
+
+	call_begin(ud);
 	HASH_FIND(hh, ud->clients, &client, sizeof(void *), e);
 	if (e) {
+#ifdef PROVEN_FILTERS
+		/* Delivery below a filter proven at SUBSCRIBE time */
+		if (access == MOSQ_ACL_READ && e->proven && topic && proven_q(e, topic))
+			return MOSQ_ERR_SUCCESS;
+#endif
 		clientid = e->clientid;
 		username = e->username;
 	} else {
@@ -629,6 +810,8 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 			return MOSQ_ERR_PLUGIN_DEFER;
 		}
 	}
+#else
+	call_begin(ud);
 #endif
 
 	if (!username || !*username) { 	// anonymous users
@@ -663,8 +846,17 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 	if (granted != MOSQ_ERR_UNKNOWN) {
 		_log(LOG_DEBUG, "aclcheck(%s, %s, %d) CACHEDAUTH: %d",
 			username, topic, access, granted);
-		return (granted);
+		goto done;
+	}
+
+	granted = acl_cache_rule_q(clientid, username, topic, access, userdata);
+	if (granted != MOSQ_ERR_UNKNOWN) {
+		_log(LOG_DEBUG, "aclcheck(%s, %s, %d) CACHEDRULE: %d",
+			username, topic, access, granted);
+		goto done;
 	}
+	granted = MOSQ_DENY_ACL;
+	memset(pre, 0, sizeof(pre));
 
 	if (!username || !*username || !topic || !*topic) {
 		granted =  MOSQ_DENY_ACL;
@@ -686,7 +878,14 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 	for (bep = ud->be_list; bep && *bep; bep++) {
 		struct backend_p *b = *bep;
 
-		match = b->superuser(b->conf, username);
+		if (b->superacl) {
+			struct prefetch *p = &pre[bep - ud->be_list];
+
+			p->match = b->superacl(b->conf, clientid, username, topic, access, &match, &p->rule);
+			p->done = true;
+		} else {
+			match = b->superuser(b->conf, username);
+		}
 		if (match == BACKEND_ALLOW) {
 			_log(LOG_DEBUG, "aclcheck(%s, %s, %d) SUPERUSER=Y by %s",
 				username, topic, access, b->name);
@@ -710,13 +909,33 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 
 	for (bep = ud->be_list; bep && *bep; bep++) {
 		struct backend_p *b = *bep;
-
-		match = b->aclcheck((*bep)->conf, clientid, username, topic, access);
+		struct prefetch *p = &pre[bep - ud->be_list];
+		char *rule = NULL;
+
+		if (p->done) {
+			/* Looked up along with the superuser check */
+			match = p->match;
+			rule = p->rule;
+			p->rule = NULL;
+		} else if (b->aclcheck_rule) {
+			match = b->aclcheck_rule(b->conf, clientid, username, topic, access, &rule);
+		} else {
+			match = b->aclcheck(b->conf, clientid, username, topic, access);
+		}
 		if (match == BACKEND_ALLOW) {
 			backend_name = b->name;
 			_log(LOG_DEBUG, "aclcheck(%s, %s, %d) trying to acl with %s",
 				username, topic, access, b->name);
 			authorized = TRUE;
+			if (rule != NULL) {
+				/*
+				 * Only if no earlier back-end could decide differently
+				 * for another topic below the rule
+				 */
+				if (rules_only)
+					acl_cache_rule(clientid, username, rule, access, userdata);
+				free(rule);
+			}
 			break;
 		} else if (match == BACKEND_DENY) {
 			backend_name = b->name;
@@ -727,6 +946,8 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 				username, topic, access, b->name);
 			has_error = TRUE;
 		}
+		if (b->aclcheck_rule == NULL)
+			rules_only = false;
 	}
 
 	_log(LOG_DEBUG, "aclcheck(%s, %s, %d) AUTHORIZED=%d by %s",
@@ -736,6 +957,10 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 
    outout:	/* goto fail goto fail */
 
+	for (n = 0; n < NBACKENDS; n++) {
+		free(pre[n].rule);
+	}
+
 	if (granted == MOSQ_DENY_ACL && has_error) {
 		_log(LOG_DEBUG, "aclcheck(%s, %s, %d) AUTHORIZED=N HAS_ERROR=Y => ERR_UNKNOWN",
 			username, topic, access);
@@ -743,6 +968,15 @@ int mosquitto_auth_acl_check(void *userdata, const char *clientid, const char *u
 	}
 
 	acl_cache(clientid, username, topic, access, granted, userdata);
+
+   done:
+#ifdef PROVEN_FILTERS
+	if (access == MOSQ_ACL_SUBSCRIBE && granted == MOSQ_ERR_SUCCESS && e != NULL &&
+	    topic && *topic && strcmp(username, e->username) == 0) {
+		proven_add(ud, e, clientid, username, topic);
+	}
+#endif
+	arena_reset(ud->arena);
 	return (granted);
 
 }
@@ -765,6 +999,7 @@ int mosquitto_auth_psk_key_get(void *userdata, const char *hint, const char *ide
 	// sprintf(username, "%s-%s", hint, identity);
 	username = (char *)identity;
 
+	call_begin(ud);
 	rc = BACKEND_DENY;
 	for (bep = ud->be_list; bep && *bep; bep++) {
 		struct backend_p *b = *bep;
@@ -797,6 +1032,8 @@ int mosquitto_auth_psk_key_get(void *userdata, const char *hint, const char *ide
 
 	// free(username);
 
+	arena_reset(ud->arena);
+
 	if (has_error) return MOSQ_ERR_UNKNOWN;
 	return (psk_found) ? MOSQ_ERR_SUCCESS : MOSQ_DENY_AUTH;
 
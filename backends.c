@@ -31,22 +31,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <mosquitto.h>
 #include "backends.h"
+#include "arena.h"
 
-/*
- * Search through `in' for tokens %c (clientid) and %u (username); build a
- * new malloc'd string at `res' with those tokens interpolated into it.
- */
-
-void t_expand(const char *clientid, const char *username, const char *in, char **res)
+static int t_expand_len(const char *ct, const char *ut, const char *in)
 {
 	const char *s;
-	char *work, *wp;
 	int c_specials = 0, u_specials = 0, len;
-	const char *ct, *ut;
-
-	ct = (clientid) ? clientid : "";
-	ut = (username) ? username : "";
 
 	for (s = in; s && *s; s++) {
 		if (*s == '%' && (*(s + 1) == 'c'))
@@ -55,13 +47,16 @@ void t_expand(const char *clientid, const char *username, const char *in, char *
 			u_specials++;
 	}
 	len = strlen(in) + 1;
-	len += strlen(clientid) * c_specials;
-	len += strlen(username) * u_specials;
+	len += strlen(ct) * c_specials;
+	len += strlen(ut) * u_specials;
+	return (len);
+}
+
+static void t_expand_into(const char *ct, const char *ut, const char *in, char *work)
+{
+	const char *s;
+	char *wp;
 
-	if ((work = malloc(len)) == NULL) {
-		*res = NULL;
-		return;
-	}
 	for (s = in, wp = work; s && *s; s++) {
 		*wp++ = *s;
 		if (*s == '%' && (*(s + 1) == 'c')) {
@@ -78,6 +73,116 @@ void t_expand(const char *clientid, const char *username, const char *in, char *
 		}
 	}
 	*wp = 0;
+}
+
+/*
+ * Search through `in' for tokens %c (clientid) and %u (username); build a
+ * new malloc'd string at `res' with those tokens interpolated into it.
+ */
+
+void t_expand(const char *clientid, const char *username, const char *in, char **res)
+{
+	char *work;
+	const char *ct, *ut;
+
+	ct = (clientid) ? clientid : "";
+	ut = (username) ? username : "";
+
+	if ((work = malloc(t_expand_len(ct, ut, in))) == NULL) {
+		*res = NULL;
+		return;
+	}
+	t_expand_into(ct, ut, in, work);
 
 	*res = work;
 }
+
+/*
+ * As t_expand(), but the result lives in the arena `a' until its reset.
+ */
+
+char *t_expand_arena(struct arena *a, const char *clientid, const char *username, const char *in)
+{
+	char *work;
+	const char *ct, *ut;
+
+	ct = (clientid) ? clientid : "";
+	ut = (username) ? username : "";
+
+	if ((work = arena_alloc(a, t_expand_len(ct, ut, in))) != NULL)
+		t_expand_into(ct, ut, in, work);
+	return (work);
+}
+
+/*
+ * Return TRUE if every topic matched by the subscription `filter' is also
+ * matched by the subscription `sub' (filter containment). A filter without
+ * wildcards is a plain topic, so this degenerates to an ordinary match.
+ */
+
+int t_covers(const char *sub, const char *filter)
+{
+	const char *s = sub, *f = filter;
+
+	if (!s || !f || !*s || !*f)
+		return (FALSE);
+
+	/* Wildcards in the first level never match $SYS-style topics */
+	if ((*s == '+' || *s == '#') && *f == '$')
+		return (FALSE);
+
+	while (*s && *f) {
+		if (*s == '#')
+			return (TRUE);
+		if (*s == '+') {
+			if (*f == '#')
+				return (FALSE);
+			while (*f && *f != '/')
+				f++;
+			s++;
+		} else {
+			if (*f == '+' || *f == '#')
+				return (FALSE);
+			while (*s && *s != '/' && *s == *f) {
+				s++;
+				f++;
+			}
+			if ((*s && *s != '/') || (*f && *f != '/'))
+				return (FALSE);
+		}
+		/* Both at a level separator or at the end of the string */
+		if (*s != *f) {
+			/* "a/#" also matches its parent "a" */
+			return (*f == 0 && strcmp(s, "/#") == 0);
+		}
+		if (*s) {
+			s++;
+			f++;
+		}
+	}
+
+	if (*s == 0 && *f == 0)
+		return (TRUE);
+	if (*f == 0 && f[-1] == '/') {
+		/* The filter ends in an empty level, which '+' also matches */
+		if (*s == '+')
+			s++;
+		return (*s == 0 || strcmp(s, "/#") == 0 || strcmp(s, "#") == 0);
+	}
+	return (*f == 0 && strcmp(s, "#") == 0);
+}
+
+/*
+ * Like mosquitto_topic_matches_sub(), but `topic' may itself be a filter
+ * with wildcards, in which case `result' tells whether `sub' matches every
+ * topic the filter can match.
+ */
+
+int t_matches(const char *sub, const char *topic, bool *result)
+{
+	if (strpbrk(topic, "+#") == NULL)
+		return mosquitto_topic_matches_sub(sub, topic, result);
+
+	*result = t_covers(sub, topic);
+	return (MOSQ_ERR_SUCCESS);
+}
@@ -49,11 +49,44 @@
 #ifndef __BACKENDS_H
 # define __BACKENDS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef void (f_kill)(void *conf);
 typedef int (f_getuser)(void *conf, const char *username, const char *password, char **phash, const char *clientid);
+
+/*
+ * Optional variant of f_getuser for back-ends which hold the hash in
+ * memory anyway: it lends `*phash', `*phashlen' bytes which need not be
+ * NUL terminated, instead of returning a malloc'd copy. The caller
+ * doesn't free it and uses it only until the call into the plugin ends.
+ */
+typedef int (f_getuser_ref)(void *conf, const char *username, const char *password, const char **phash, size_t *phashlen, const char *clientid);
+
 typedef int (f_superuser)(void *conf, const char *username);
 typedef int (f_aclcheck)(void *conf, const char *clientid, const char *username, const char *topic, int acc);
 
+/*
+ * Optional variant of f_aclcheck. When it returns BACKEND_ALLOW a back-end
+ * may set `rule' to a malloc'd copy of the (expanded) subscription filter
+ * which granted access; the caller frees it. The ACL cache then uses that
+ * filter to answer later checks on any topic it matches.
+ */
+typedef int (f_aclcheck_rule)(void *conf, const char *clientid, const char *username, const char *topic, int acc, char **rule);
+
+/*
+ * Optional: f_superuser and f_aclcheck_rule of one ACL check in one go,
+ * for back-ends which can look up both for the price of one. The
+ * superuser result goes to `*super'; the ACL result is returned and is
+ * used only if no back-end decides on the superuser check.
+ */
+typedef int (f_superacl)(void *conf, const char *clientid, const char *username, const char *topic, int acc, int *super, char **rule);
+
+struct arena;
+
 void t_expand(const char *clientid, const char *username, const char *in, char **res);
+char *t_expand_arena(struct arena *a, const char *clientid, const char *username, const char *in);
+int t_covers(const char *sub, const char *filter);
+int t_matches(const char *sub, const char *topic, bool *result);
 
 #endif
@@ -34,42 +34,133 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <cdb.h>
 #include <mosquitto.h>
 #include "backends.h"
 #include "be-cdb.h"
 #include "log.h"
 #include "hash.h"
+#include "arena.h"
+#include "matcher.h"
+#include "rcu.h"
 
-void *be_cdb_init()
+static void cdb_aclentry_free(struct cdb_aclentry *e)
 {
-	struct cdb_backend *conf;
-	char *cdbname;
-	int fd;
+	matcher_free(e->m);
+	free(e->username);
+	free(e);
+}
 
-	if ((cdbname = p_stab("cdbname")) == NULL)
-		_fatal("Mandatory parameter `cdbname' missing");
+static void db_free(struct cdb_db *db)
+{
+	struct cdb_aclentry *e, *tmp;
+
+	HASH_ITER(hh, db->acls, e, tmp) {
+		HASH_DEL(db->acls, e);
+		cdb_aclentry_free(e);
+	}
+	cdb_free(&db->cdb);
+	close(cdb_fileno(&db->cdb));
+	free(db);
+}
+
+static void db_release(struct rcu_head *head)
+{
+	db_free((struct cdb_db *)head);
+}
+
+/*
+ * Open and map the database file. The file is identified by the
+ * descriptor actually opened, so a replacement racing with us is
+ * noticed at the next check.
+ */
+
+static struct cdb_db *db_open(const char *cdbname)
+{
+	struct cdb_db *db;
+	struct stat st;
+	int fd;
 
 	if ((fd = open(cdbname, O_RDONLY)) == -1) {
-		perror(cdbname);
+		_log(LOG_NOTICE, "cdb: can't open %s: %s", cdbname, strerror(errno));
+		return (NULL);
+	}
+	if (fstat(fd, &st) != 0 || (db = calloc(1, sizeof(struct cdb_db))) == NULL) {
+		close(fd);
+		return (NULL);
+	}
+	if (cdb_init(&db->cdb, fd) != 0) {
+		_log(LOG_NOTICE, "cdb: %s is not a valid database", cdbname);
+		free(db);
+		close(fd);
 		return (NULL);
 	}
 
-	conf = malloc(sizeof(struct cdb_backend));
+	db->dev		= st.st_dev;
+	db->ino		= st.st_ino;
+	db->mtime	= st.st_mtime;
+	db->size	= st.st_size;
+	return (db);
+}
+
+/*
+ * Return the database to use for this call. Every `cdb_reload_interval'
+ * seconds the file is stat()ed, and if it was replaced, the new one is
+ * opened and swapped in. The old one is retired and unmapped at the
+ * start of the next call, after any lookup on it is done; its compiled
+ * ACLs go with it.
+ */
+
+static struct cdb_db *current(struct cdb_backend *conf)
+{
+	struct cdb_db *db = conf->db;
+	struct stat st;
+	time_t now;
+
+	if (conf->reload_interval <= 0 || (now = time(NULL)) < conf->next_check)
+		return (db);
+	conf->next_check = now + conf->reload_interval;
+
+	if (stat(conf->cdbname, &st) != 0 ||
+	    (st.st_dev == db->dev && st.st_ino == db->ino &&
+	     st.st_mtime == db->mtime && st.st_size == db->size))
+		return (db);
+
+	if ((db = db_open(conf->cdbname)) == NULL)
+		return (conf->db);
+
+	_log(LOG_NOTICE, "cdb: %s changed, reloaded", conf->cdbname);
+	rcu_retire(&conf->db->rcu, db_release);
+	conf->db = db;
+	return (db);
+}
+
+void *be_cdb_init()
+{
+	struct cdb_backend *conf;
+	char *cdbname, *interval;
+
+	if ((cdbname = p_stab("cdbname")) == NULL)
+		_fatal("Mandatory parameter `cdbname' missing");
+
+	conf = calloc(1, sizeof(struct cdb_backend));
 	if (conf == NULL) {
 		return (NULL);
 	}
 
-	conf->cdbname	= strdup(cdbname);
-	conf->cdb	= (struct cdb *)malloc(sizeof(struct cdb));
-
-	if (conf->cdb == NULL) {
+	if ((conf->cdbname = strdup(cdbname)) == NULL ||
+	    (conf->db = db_open(cdbname)) == NULL) {
 		free(conf->cdbname);
 		free(conf);
 		return (NULL);
 	}
 
-	cdb_init(conf->cdb, fd);
+	if ((interval = p_stab("cdb_reload_interval")) != NULL)
+		conf->reload_interval = atoi(interval);
+	conf->next_check = time(NULL) + conf->reload_interval;
 
 	return (conf);
 }
@@ -79,78 +170,136 @@ void be_cdb_destroy(void *handle)
 	struct cdb_backend *conf = (struct cdb_backend *)handle;
 
 	if (conf) {
-		cdb_free(conf->cdb);
+		db_free(conf->db);
 		free(conf->cdbname);
 		free(conf);
 	}
 }
 
-int be_cdb_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
+/*
+ * Lend the user's hash straight from the mapping. It stays valid until
+ * the end of the call, as a replaced database is only unmapped after.
+ */
+
+int be_cdb_getuser_ref(void *handle, const char *username, const char *password, const char **phash, size_t *phashlen, const char *clientid)
 {
 	struct cdb_backend *conf = (struct cdb_backend *)handle;
-	char *k, *v = NULL;
-	unsigned klen;
+	struct cdb *cdb;
 
+	*phash = NULL;
 	if (!conf || !username || !*username)
 		return (FALSE);
 
-	k = (char *)username;
-	klen = strlen(k);
-
-	if (cdb_find(conf->cdb, k, klen) > 0) {
-		int vpos = cdb_datapos(conf->cdb);
-		int vlen = cdb_datalen(conf->cdb);
-
-		if ((v = malloc(vlen + 1)) != NULL) {
-			cdb_read(conf->cdb, v, vlen, vpos);
-			v[vlen] = 0;
-		}
+	cdb = &current(conf)->cdb;
+	if (cdb_find(cdb, username, strlen(username)) > 0) {
+		*phash = cdb_getdata(cdb);
+		*phashlen = cdb_datalen(cdb);
 	}
-
-	*phash = v;
 	return BACKEND_DEFER;
 }
 
+int be_cdb_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
+{
+	const char *v;
+	size_t vlen;
+	int rc;
+
+	rc = be_cdb_getuser_ref(handle, username, password, &v, &vlen, clientid);
+	*phash = v ? strndup(v, vlen) : NULL;
+	return (rc);
+}
+
 /*
- * Check access to topic for username. Look values for a key "acl:username"
- * and use mosquitto_topic_matches_sub() to validate the topic.
+ * Compile all "acl:username" values into a matcher. A value is a
+ * subscription filter, optionally preceded by the access bits it
+ * grants and a colon (e.g. "1:sensors/#" is read-only); without
+ * a prefix the filter grants every kind of access.
  */
 
-int be_cdb_access(void *handle, const char *username, char *topic)
+static struct matcher *cdb_compile(struct cdb_db *db, const char *username)
 {
-	struct cdb_backend *conf = (struct cdb_backend *)handle;
-	char *k;
-	unsigned klen;
-	int found = 0;
+	struct matcher *m;
 	struct cdb_find cdbf;
-	bool bf;
+	char *k;
 
-	if (!conf || !username || !topic)
-		return (0);
+	if ((m = matcher_new(username)) == NULL)
+		return (NULL);
+	if ((k = arena_sprintf(be_arena, "acl:%s", username)) == NULL) {
+		matcher_free(m);
+		return (NULL);
+	}
+
+	cdb_findinit(&cdbf, &db->cdb, k, strlen(k));
+	while (cdb_findnext(&cdbf) > 0) {
+		const char *val = cdb_getdata(&db->cdb);
+		unsigned vlen = cdb_datalen(&db->cdb), n;
+		int bits = 0, access = ~0;
+		char *filter;
+
+		if (val == NULL) {
+			matcher_free(m);
+			return (NULL);
+		}
+		for (n = 0; n < vlen && n < 4 && val[n] >= '0' && val[n] <= '9'; n++)
+			bits = bits * 10 + (val[n] - '0');
+		if (n > 0 && n < vlen && val[n] == ':') {
+			access = bits;
+			val += n + 1;
+			vlen -= n + 1;
+		}
 
-	if ((k = malloc(strlen(username) + strlen("acl:") + 2)) == NULL)
-		return (0);
-	sprintf(k, "acl:%s", username);
-	klen = strlen(k);
+		/* the matcher wants a string; the arena spares us a malloc */
+		if ((filter = arena_alloc(be_arena, vlen + 1)) == NULL) {
+			matcher_free(m);
+			return (NULL);
+		}
+		memcpy(filter, val, vlen);
+		filter[vlen] = 0;
 
-	cdb_findinit(&cdbf, conf->cdb, k, klen);
-	while ((cdb_findnext(&cdbf) > 0) && (!found)) {
-		unsigned vpos = cdb_datapos(conf->cdb);
-		unsigned vlen = cdb_datalen(conf->cdb);
-		char *val;
+		if (matcher_add(m, filter, access) != 0) {
+			matcher_free(m);
+			return (NULL);
+		}
+	}
 
-		val = malloc(vlen);
-		cdb_read(conf->cdb, val, vlen, vpos);
+	_log(LOG_DEBUG, "cdb: compiled %d ACL rule(s) for %s", matcher_count(m), username);
+	return (m);
+}
 
-		mosquitto_topic_matches_sub(val, topic, &bf);
-		found |= bf;
+/*
+ * Return the user's compiled matcher, building it on first use. Users
+ * without ACL records get an empty one, so they too are looked up only
+ * once. When the cache is full the least recently compiled entry goes.
+ */
+
+static struct matcher *cdb_matcher(struct cdb_db *db, const char *username)
+{
+	struct cdb_aclentry *e;
 
-		free(val);
+	HASH_FIND_STR(db->acls, username, e);
+	if (e != NULL)
+		return (e->m);
+
+	if ((e = malloc(sizeof(struct cdb_aclentry))) == NULL)
+		return (NULL);
+	if ((e->m = cdb_compile(db, username)) == NULL) {
+		free(e);
+		return (NULL);
+	}
+	if ((e->username = strdup(username)) == NULL) {
+		matcher_free(e->m);
+		free(e);
+		return (NULL);
 	}
 
-	free(k);
+	if (HASH_COUNT(db->acls) >= MAXCDBACLS) {
+		struct cdb_aclentry *old = db->acls;	/* insertion order */
 
-	return (found > 0);
+		HASH_DEL(db->acls, old);
+		cdb_aclentry_free(old);
+	}
+	HASH_ADD_KEYPTR(hh, db->acls, e->username, strlen(e->username), e);
+	return (e->m);
 }
 
 int be_cdb_superuser(void *handle, const char *username)
@@ -160,8 +309,20 @@ int be_cdb_superuser(void *handle, const char *username)
 
 int be_cdb_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
-	/* FIXME: implement. Currently TRUE */
+	return be_cdb_aclcheck_rule(handle, clientid, username, topic, acc, NULL);
+}
+
+int be_cdb_aclcheck_rule(void *handle, const char *clientid, const char *username, const char *topic, int acc, char **rule)
+{
+	struct cdb_backend *conf = (struct cdb_backend *)handle;
+	struct matcher *m;
+
+	if (!conf || !username || !topic)
+		return BACKEND_DEFER;
+
+	if ((m = cdb_matcher(current(conf), username)) == NULL)
+		return BACKEND_ERROR;
 
-	return BACKEND_ALLOW;
+	return matcher_match(m, clientid, topic, acc, rule) ? BACKEND_ALLOW : BACKEND_DEFER;
 }
 #endif /* BE_CDB */
@@ -29,15 +29,46 @@
 
 #ifdef BE_CDB
 
+#include <sys/types.h>
+#include <time.h>
+#include <cdb.h>
+#include "uthash.h"
+#include "rcu.h"
+
+#define MAXCDBACLS	(10000)		/* users with a compiled matcher */
+
+struct cdb_aclentry {
+	char *username;
+	struct matcher *m;
+	UT_hash_handle hh;
+};
+
+/*
+ * One mapped version of the database file; replaced when the file is.
+ */
+
+struct cdb_db {
+	struct rcu_head rcu;		/* first */
+	struct cdb cdb;
+	dev_t dev;			/* identity of the file mapped */
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	struct cdb_aclentry *acls;	/* compiled "acl:" records by user */
+};
+
 struct cdb_backend {
 	char *cdbname;
-	struct cdb *cdb;
+	struct cdb_db *db;
+	int reload_interval;		/* seconds between stat()s; 0: never */
+	time_t next_check;
 };
 
 void *be_cdb_init();
 void be_cdb_destroy(void *handle);
 int be_cdb_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid);
-int be_cdb_access(void *handle, const char *username, char *topic);
+int be_cdb_getuser_ref(void *handle, const char *username, const char *password, const char **phash, size_t *phashlen, const char *clientid);
 int be_cdb_superuser(void *handle, const char *username);
 int be_cdb_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc);
+int be_cdb_aclcheck_rule(void *handle, const char *clientid, const char *username, const char *topic, int acc, char **rule);
 #endif /* BE_CDB */
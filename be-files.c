@@ -35,13 +35,26 @@
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <mosquitto.h>
 #include <mosquitto_plugin.h>
 #include <mosquitto_broker.h>
 #include "log.h"
 #include "hash.h"
+#include "uthash.h"
 #include "backends.h"
 #include "be-files.h"
+#include "files-image.h"
+#include "cache.h"
+#include "rcu.h"
 
 #if (LIBMOSQUITTO_MAJOR > 1) || ((LIBMOSQUITTO_MAJOR == 1) && (LIBMOSQUITTO_MINOR >= 4))
 #define LOG(lvl, fmt, ...) mosquitto_log_printf(lvl, fmt, ##__VA_ARGS__)
@@ -123,28 +136,57 @@ typedef struct pwd_entry {
 	char *username;
 	char *password;
 	dllist acl_entries;
+	UT_hash_handle hh;		/* in files_data.byname */
 } pwd_entry;
 
-typedef struct be_files {
+/*
+ * Everything loaded from the files: an immutable snapshot, replaced as a
+ * whole when the files change (see files_watch()).
+ */
+typedef struct files_data {
+	struct rcu_head rcu;		/* must be first */
 	dllist passwords;
+	pwd_entry *byname;		/* index on username */
+	dllist acl_entries;		/* pattern lines, and topics before any user */
 	bool acl_checks;
-} be_files;
+	struct fimage *image;		/* files_image, instead of the above */
+	bool background;		/* being loaded off the broker thread */
+	int warnings;
+} files_data;
 
+typedef struct be_files {
+	_Atomic(files_data *) data;
+	char *password_file;
+	char *acl_file;
+	char *image_file;
+	int reload_interval;		/* seconds between stat()s; 0: no reloading */
+	pthread_t watcher;
+	int stopfd[2];
+	_Atomic(char *) message;	/* from the watcher, logged by the broker thread */
+} be_files;
 
-static dllist acl_entries = {{&acl_entries.head, &acl_entries.head}};
+/* for be_files_aclpatterns_*(), which have no handle */
+static be_files *patterns_conf = NULL;
 
-static pwd_entry *find_pwd(be_files * conf, const char *username)
+static pwd_entry *find_pwd(files_data * conf, const char *username)
 {
-	pwd_entry *iter;
+	pwd_entry *pwd;
 
-	dllist_for_each_element(&conf->passwords, iter, entry) {
-		if (strcmp(username, iter->username) == 0)
-			return iter;
-	}
-	return NULL;
+	HASH_FIND_STR(conf->byname, username, pwd);
+	return pwd;
 }
 
-static bool read_passwords(be_files * conf, FILE * file)
+static void add_pwd(files_data * conf, pwd_entry * pwd)
+{
+	dllist_push_back(&conf->passwords, &pwd->entry);
+	HASH_ADD_KEYPTR(hh, conf->byname, pwd->username, strlen(pwd->username), pwd);
+}
+
+/* Parse warnings are only logged from the broker thread. */
+#define WARN(d, fmt, ...) \
+	do { (d)->warnings++; if (!(d)->background) LOG(MOSQ_LOG_WARNING, fmt, ##__VA_ARGS__); } while (0)
+
+static bool read_passwords(files_data * conf, FILE * file)
 {
 	char line[512];
 	char *pos;
@@ -167,12 +209,17 @@ static bool read_passwords(be_files * conf, FILE * file)
 			pos = strchr(password, '\n');
 			if (pos != NULL)
 				*pos = '\0';
+			if (find_pwd(conf, username) != NULL) {
+				/* the first entry for a user has always won */
+				WARN(conf, "duplicate user in password file: %s", username);
+				continue;
+			}
 			entry = (pwd_entry *) malloc(sizeof(pwd_entry));
 			dllist_entry_init(&entry->entry);
 			dllist_init(&entry->acl_entries);
 			entry->username = strdup(username);
 			entry->password = strdup(password);
-			dllist_push_back(&conf->passwords, &entry->entry);
+			add_pwd(conf, entry);
 		}
 	}
 	return true;
@@ -215,7 +262,7 @@ static acl_entry *read_acl_line(const char *line)
  * (user)[ \t]+([^ \t]+) (topic|pattern)[ \t]+(read|write)?[ \t][^ \t]+
  */
 
-static bool read_acl(be_files * conf, FILE * file)
+static bool read_acl(files_data * conf, FILE * file)
 {
 	char line[512];
 	char *pos;
@@ -245,7 +292,7 @@ static bool read_acl(be_files * conf, FILE * file)
 				dllist_init(&pwd->acl_entries);
 				pwd->username = strdup(username);
 				pwd->password = NULL;
-				dllist_push_back(&conf->passwords, &pwd->entry);
+				add_pwd(conf, pwd);
 			}
 		} else if (strncmp("topic", pos, 5) == 0) {
 			for (pos = pos + 5; (*pos == ' ' || *pos == '\t') && *pos != '\0'; ++pos);
@@ -253,84 +300,445 @@ static bool read_acl(be_files * conf, FILE * file)
 			if (pwd != NULL)
 				dllist_push_back(&pwd->acl_entries, &entry->entry);
 			else
-				dllist_push_back(&acl_entries, &entry->entry);
+				dllist_push_back(&conf->acl_entries, &entry->entry);
 		} else if (strncmp("pattern", pos, 7) == 0) {
 			for (pos = pos + 7; (*pos == ' ' || *pos == '\t') && *pos != '\0'; ++pos);
 			entry = read_acl_line(pos);
-			dllist_push_back(&acl_entries, &entry->entry);
+			dllist_push_back(&conf->acl_entries, &entry->entry);
 		} else {
-			LOG(MOSQ_LOG_WARNING, "failed to parse line: %s", line);
+			WARN(conf, "failed to parse line: %s", line);
 		}
 	}
 	return true;
 }
 
-void *be_files_init()
+static void free_acl(dllist * list)
 {
-	const char *path;
+	acl_entry *acl;
+
+	while (!dllist_empty(list)) {
+		acl = dllist_entry_element(list->head.next, acl_entry, entry);
+		dllist_entry_remove(&acl->entry);
+		if (acl->topic)
+			free(acl->topic);
+		free(acl);
+	}
+}
+
+static void data_free(files_data * data)
+{
+	pwd_entry *pwd;
+
+	HASH_CLEAR(hh, data->byname);
+	while (!dllist_empty(&data->passwords)) {
+		pwd = dllist_entry_element(data->passwords.head.next, pwd_entry, entry);
+		dllist_entry_remove(&pwd->entry);
+		if (pwd->username)
+			free(pwd->username);
+		if (pwd->password)
+			free(pwd->password);
+		free_acl(&pwd->acl_entries);
+		free(pwd);
+	}
+
+	free_acl(&data->acl_entries);
+
+	fimage_close(data->image);
+	free(data);
+}
+
+static void data_release(struct rcu_head *head)
+{
+	data_free((files_data *) head);
+}
+
+/*
+ * Load a snapshot from the configured files. On error, returns NULL and
+ * leaves a description in `err'.
+ */
+static files_data *data_load(be_files * conf, bool background, char *err, size_t errlen)
+{
+	files_data *data = (files_data *) calloc(1, sizeof(files_data));
 	FILE *file;
-	be_files *const conf = (be_files *) malloc(sizeof(be_files));
 
-	dllist_init(&conf->passwords);
-	conf->acl_checks = false;
+	if (data == NULL) {
+		snprintf(err, errlen, "out of memory");
+		return NULL;
+	}
+	dllist_init(&data->passwords);
+	dllist_init(&data->acl_entries);
+	data->byname = NULL;
+	data->acl_checks = false;
+	data->image = NULL;
+	data->background = background;
+
+	/*
+	 * A compiled image (see mkfimage) replaces both text files; it is
+	 * mapped, not read, so startup doesn't depend on its size.
+	 */
+	if (conf->image_file != NULL) {
+		const char *errstr;
+
+		if ((data->image = fimage_open(conf->image_file, &errstr)) == NULL) {
+			snprintf(err, errlen, "failed to load files image %s: %s", conf->image_file, errstr);
+			data_free(data);
+			return NULL;
+		}
+		data->acl_checks = data->image->hdr->acl_checks != 0;
+		return data;
+	}
 
-	path = p_stab("password_file");
-	file = (path == NULL) ? NULL : fopen(path, "r");
-	if (path != NULL && file == NULL) {
-		LOG(MOSQ_LOG_ERR, "failed to open password file: %s", path);
-		be_files_destroy(conf);
+	file = (conf->password_file == NULL) ? NULL : fopen(conf->password_file, "r");
+	if (conf->password_file != NULL && file == NULL) {
+		snprintf(err, errlen, "failed to open password file: %s", conf->password_file);
+		data_free(data);
 		return NULL;
 	}
 	if (file != NULL) {
-		read_passwords(conf, file);
+		read_passwords(data, file);
 		fclose(file);
 	}
-	path = p_stab("acl_file");
-	conf->acl_checks = path != NULL;
-	file = (path == NULL) ? NULL : fopen(path, "r");
-	if (path != NULL && file == NULL) {
-		LOG(MOSQ_LOG_ERR, "failed to open ACL file: %s", path);
-		be_files_destroy(conf);
+	data->acl_checks = conf->acl_file != NULL;
+	file = (conf->acl_file == NULL) ? NULL : fopen(conf->acl_file, "r");
+	if (conf->acl_file != NULL && file == NULL) {
+		snprintf(err, errlen, "failed to open ACL file: %s", conf->acl_file);
+		data_free(data);
 		return NULL;
 	}
 	if (file != NULL) {
-		read_acl(conf, file);
+		read_acl(data, file);
 		fclose(file);
 	}
-	return conf;
+	return data;
 }
 
-static void free_acl(dllist * list)
+static unsigned long data_nusers(const files_data * data)
 {
-	acl_entry *acl;
+	return data->image ? data->image->hdr->nusers : HASH_COUNT(data->byname);
+}
 
-	while (!dllist_empty(list)) {
-		acl = dllist_entry_element(list->head.next, acl_entry, entry);
-		dllist_entry_remove(&acl->entry);
-		if (acl->topic)
-			free(acl->topic);
-		free(acl);
+/*
+ * Digest of what a snapshot says about one user (password and ACL rules)
+ * or, for username NULL, about everybody (the global rules); comparing
+ * digests tells which cached answers a reload makes stale.
+ */
+
+#define DIGEST(h, p, len) \
+	do { const unsigned char *_p = (const unsigned char *)(p); size_t _n = (len); \
+	     while (_n--) { h ^= *_p++; h *= 0x100000001b3ULL; } } while (0)
+
+static uint64_t data_digest(const files_data * data, const char *username)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	unsigned char acc;
+
+	if (data->image) {
+		const struct fimage *fi = data->image;
+		const struct fi_user *u = NULL;
+		const struct fi_rule *r, *first, *end;
+
+		if (username != NULL) {
+			if ((u = fimage_user(fi, username)) == NULL)
+				return 0;
+			if (u->password != FI_NONE)
+				DIGEST(h, fimage_str(fi, u->password), strlen(fimage_str(fi, u->password)) + 1);
+			first = &fi->rules[u->rule_first];
+			end = first + u->rule_count;
+		} else {
+			first = &fi->rules[fi->hdr->global_first];
+			end = first + fi->hdr->global_count;
+		}
+		for (r = first; r < end; r++) {
+			acc = r->access;
+			DIGEST(h, &acc, 1);
+			DIGEST(h, fimage_str(fi, r->topic), strlen(fimage_str(fi, r->topic)) + 1);
+		}
+	} else {
+		const dllist *list = &data->acl_entries;
+		acl_entry *acl;
+
+		if (username != NULL) {
+			pwd_entry *pwd = find_pwd((files_data *) data, username);
+
+			if (pwd == NULL)
+				return 0;
+			if (pwd->password)
+				DIGEST(h, pwd->password, strlen(pwd->password) + 1);
+			list = &pwd->acl_entries;
+		}
+		dllist_for_each_element(list, acl, entry) {
+			acc = acl->access;
+			DIGEST(h, &acc, 1);
+			DIGEST(h, acl->topic, strlen(acl->topic) + 1);
+		}
 	}
+	return h;
+}
+
+/*
+ * Call fn() for each username in `data'.
+ */
+static void data_users(const files_data * data, void (*fn)(const char *username, void *arg), void *arg)
+{
+	if (data->image) {
+		uint32_t n;
+
+		for (n = 0; n < data->image->hdr->nusers; n++)
+			fn(fimage_str(data->image, data->image->users[n].name), arg);
+	} else {
+		pwd_entry *pwd;
+
+		dllist_for_each_element(&data->passwords, pwd, entry)
+			fn(pwd->username, arg);
+	}
+}
+
+#define MAXINVALIDATE	(1000)		/* changed users; beyond, drop all */
+
+struct diff {
+	const files_data *a, *b;
+	unsigned long changed;
+	bool removed_only;		/* count users missing from b only */
+	bool apply;
+};
+
+static void diff_user(const char *username, void *arg)
+{
+	struct diff *d = (struct diff *)arg;
+	uint64_t in_b = data_digest(d->b, username);
+
+	if (d->removed_only ? in_b == 0 : data_digest(d->a, username) != in_b) {
+		d->changed++;
+		if (d->apply)
+			cache_invalidate(username);
+	}
+}
+
+/*
+ * Ask the dispatcher to drop cached answers which `new' may contradict:
+ * those of users whose entries changed or, if the global rules changed or
+ * too many users did, all of them.
+ */
+static unsigned long invalidate_changed(const files_data * old, const files_data * new)
+{
+	struct diff d;
+
+	if (old->acl_checks != new->acl_checks || data_digest(old, NULL) != data_digest(new, NULL)) {
+		cache_invalidate(NULL);
+		return data_nusers(new);
+	}
+
+	/* count first, then invalidate unless there are too many */
+	for (d.apply = false; ; d.apply = true) {
+		d.changed = 0;
+		d.a = old;
+		d.b = new;
+		d.removed_only = false;
+		data_users(new, diff_user, &d);
+		d.removed_only = true;
+		data_users(old, diff_user, &d);
+
+		if (d.apply)
+			break;
+		if (d.changed > MAXINVALIDATE) {
+			cache_invalidate(NULL);
+			break;
+		}
+	}
+	return d.changed;
+}
+
+static void post_message(be_files * conf, char *msg)
+{
+	free(atomic_exchange(&conf->message, msg));
+}
+
+/*
+ * Current snapshot, valid until the broker thread returns to mosquitto.
+ */
+static files_data *current(be_files * conf)
+{
+	char *msg;
+
+	if (atomic_load_explicit(&conf->message, memory_order_relaxed) != NULL &&
+	    (msg = atomic_exchange(&conf->message, NULL)) != NULL) {
+		LOG(MOSQ_LOG_NOTICE, "%s", msg);
+		free(msg);
+	}
+	return atomic_load_explicit(&conf->data, memory_order_acquire);
+}
+
+struct watched {
+	const char *path;
+	struct stat st;
+	bool exists;
+};
+
+/*
+ * stat() the files and note whether any of them was replaced, modified,
+ * created or removed since last time.
+ */
+static bool files_changed(struct watched *w, int nw)
+{
+	struct stat st;
+	bool changed = false, exists;
+	int i;
+
+	for (i = 0; i < nw; i++) {
+		exists = stat(w[i].path, &st) == 0;
+		if (exists != w[i].exists || (exists &&
+		    (st.st_ino != w[i].st.st_ino || st.st_dev != w[i].st.st_dev ||
+		     st.st_size != w[i].st.st_size || st.st_mtime != w[i].st.st_mtime ||
+		     st.st_ctime != w[i].st.st_ctime)))
+			changed = true;
+		w[i].exists = exists;
+		if (exists)
+			w[i].st = st;
+	}
+	return changed;
+}
+
+/*
+ * Watcher thread: wait for the files to change (inotify on their
+ * directories, so that rename-replace is seen, with a periodic stat() as
+ * a fallback), load a new snapshot and publish it. Checks running on the
+ * broker thread keep the snapshot they started with; the old one is freed
+ * once the broker thread has moved on (see rcu.h).
+ */
+static void *files_watch(void *arg)
+{
+	be_files *conf = (be_files *) arg;
+	struct watched w[3];
+	struct pollfd pfd[2];
+	files_data *data, *old;
+	char err[512], buf[4096];
+	int nw = 0, npfd = 1, i;
+
+	if (conf->image_file)
+		w[nw++].path = conf->image_file;
+	if (conf->password_file)
+		w[nw++].path = conf->password_file;
+	if (conf->acl_file)
+		w[nw++].path = conf->acl_file;
+	for (i = 0; i < nw; i++)
+		w[i].exists = false;
+	files_changed(w, nw);
+
+	pfd[0].fd = conf->stopfd[0];
+	pfd[0].events = POLLIN;
+#ifdef __linux__
+	if ((pfd[1].fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) != -1) {
+		for (i = 0; i < nw; i++) {
+			char *dir = strdup(w[i].path);
+
+			if (dir != NULL) {
+				inotify_add_watch(pfd[1].fd, dirname(dir),
+					IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ATTRIB);
+				free(dir);
+			}
+		}
+		pfd[1].events = POLLIN;
+		npfd = 2;
+	}
+#endif
+
+	for (;;) {
+		if (poll(pfd, npfd, conf->reload_interval * 1000) > 0) {
+			if (pfd[0].revents)
+				break;
+			if (npfd > 1 && pfd[1].revents) {
+				/* let a writer finish before looking */
+				while (read(pfd[1].fd, buf, sizeof(buf)) > 0)
+					;
+				usleep(200000);
+				while (read(pfd[1].fd, buf, sizeof(buf)) > 0)
+					;
+			}
+		}
+		if (!files_changed(w, nw))
+			continue;
+
+		if ((data = data_load(conf, true, err, sizeof(err))) == NULL) {
+			post_message(conf, strdup(err));
+			continue;
+		}
+
+		old = atomic_exchange_explicit(&conf->data, data, memory_order_acq_rel);
+		snprintf(err, sizeof(err), "files reloaded: %lu users, %d warnings, %lu users invalidated",
+			data_nusers(data), data->warnings, invalidate_changed(old, data));
+		post_message(conf, strdup(err));
+		rcu_retire(&old->rcu, data_release);
+	}
+
+	if (npfd > 1)
+		close(pfd[1].fd);
+	return NULL;
+}
+
+void *be_files_init()
+{
+	const char *path;
+	char *interval, err[512];
+	files_data *data;
+	be_files *const conf = (be_files *) calloc(1, sizeof(be_files));
+
+	conf->stopfd[0] = conf->stopfd[1] = -1;
+	if ((path = p_stab("files_image")) != NULL)
+		conf->image_file = strdup(path);
+	if ((path = p_stab("password_file")) != NULL)
+		conf->password_file = strdup(path);
+	if ((path = p_stab("acl_file")) != NULL)
+		conf->acl_file = strdup(path);
+	if ((interval = p_stab("files_reload_interval")) != NULL)
+		conf->reload_interval = atoi(interval);
+
+	if ((data = data_load(conf, false, err, sizeof(err))) == NULL) {
+		LOG(MOSQ_LOG_ERR, "%s", err);
+		be_files_destroy(conf);
+		return NULL;
+	}
+	atomic_init(&conf->data, data);
+	atomic_init(&conf->message, NULL);
+	if (data->image) {
+		LOG(MOSQ_LOG_NOTICE, "files image %s: %u users, %u rules",
+			conf->image_file, data->image->hdr->nusers, data->image->hdr->nrules);
+	}
+
+	if (conf->reload_interval > 0) {
+		if (pipe(conf->stopfd) != 0 ||
+		    pthread_create(&conf->watcher, NULL, files_watch, conf) != 0) {
+			LOG(MOSQ_LOG_ERR, "files: cannot start watcher, reloading disabled");
+			conf->reload_interval = 0;
+		}
+	}
+
+	patterns_conf = conf;
+	return conf;
 }
 
 void be_files_destroy(void *handle)
 {
 	be_files *const conf = (be_files *) handle;
-	pwd_entry *pwd;
+	files_data *data;
 
-	while (!dllist_empty(&conf->passwords)) {
-		pwd = dllist_entry_element(conf->passwords.head.next, pwd_entry, entry);
-		dllist_entry_remove(&pwd->entry);
-		if (pwd->username)
-			free(pwd->username);
-		if (pwd->password)
-			free(pwd->password);
-		free_acl(&pwd->acl_entries);
-		free(pwd);
+	if (conf->reload_interval > 0) {
+		if (write(conf->stopfd[1], "", 1) == 1)
+			pthread_join(conf->watcher, NULL);
+	}
+	if (conf->stopfd[0] != -1) {
+		close(conf->stopfd[0]);
+		close(conf->stopfd[1]);
 	}
 
-	free_acl(&acl_entries);
+	if ((data = atomic_load(&conf->data)) != NULL)
+		data_free(data);
+	free(atomic_load(&conf->message));
 
+	if (patterns_conf == conf)
+		patterns_conf = NULL;
+	free(conf->image_file);
+	free(conf->password_file);
+	free(conf->acl_file);
 	free(conf);
 }
 
@@ -339,9 +747,18 @@ int be_files_getuser(void *handle,
 		            const char *password,
 		            char **phash, const char *clientid)
 {
-	be_files *const conf = (be_files *) handle;
-	pwd_entry *entry = find_pwd(conf, username);
+	files_data *const conf = current((be_files *) handle);
+	pwd_entry *entry;
+
+	if (conf->image) {
+		const struct fi_user *u = fimage_user(conf->image, username);
 
+		*phash = (u == NULL || u->password == FI_NONE) ? NULL :
+			strdup(fimage_str(conf->image, u->password));
+		return BACKEND_DEFER;
+	}
+
+	entry = find_pwd(conf, username);
 	*phash = (entry == NULL || entry->password == NULL) ? NULL : strdup(entry->password);
 	return BACKEND_DEFER;
 }
@@ -351,51 +768,110 @@ int be_files_superuser(void *handle, const char *username)
 	return 0;
 }
 
-static int do_aclcheck(dllist * acl_list,
-		           const char *clientid,
-		           const char *username,
-		           const char *topic,
-		           int access)
+/*
+ * Substitute %c and %u in an ACL topic, as mosquitto does for patterns.
+ */
+static void expand_topic(const char *topic,
+		         const char *clientid,
+		         const char *username,
+		         char *buf, size_t bufsize)
 {
-	char buf[512];
-	bool ret;
-	acl_entry *acl;
 	const char *t;
 	const char *si;
-	char *di;
+	char *di, *end = buf + bufsize - 1;
 
-	dllist_for_each_element(acl_list, acl, entry) {
-		for (si = acl->topic, di = buf; *si != '\0';) {
+	for (si = topic, di = buf; *si != '\0' && di < end;) {
+		switch (*si) {
+		case '%':
+			++si;
 			switch (*si) {
-			case '%':
+			case 'c':
+				++si;
+				for (t = clientid; *t != '\0' && di < end; ++di, ++t)
+					*di = *t;
+				break;
+			case 'u':
 				++si;
-				switch (*si) {
-				case 'c':
-					++si;
-					for (t = clientid; *t != '\0'; ++di, ++t)
-						*di = *t;
-					break;
-				case 'u':
-					++si;
-					for (t = username; *t != '\0'; ++di, ++t)
-						*di = *t;
-					break;
-				default:
-					*di++ = *si;
-					break;
-				}
+				for (t = username; *t != '\0' && di < end; ++di, ++t)
+					*di = *t;
 				break;
 			default:
-				*di++ = *si++;
+				*di++ = *si;
 				break;
 			}
+			break;
+		default:
+			*di++ = *si++;
+			break;
 		}
-		*di = '\0';
-		if (mosquitto_topic_matches_sub(buf, topic, &ret) != MOSQ_ERR_SUCCESS) {
-			LOG(MOSQ_LOG_ERR, "invalid topic '%s'", buf);
-		} else if (ret && (access & acl->access) != 0) {
+	}
+	*di = '\0';
+}
+
+static int match_rule(const char *pattern,
+		      int rule_access,
+		      const char *topic,
+		      int access,
+		      char **rule)
+{
+	bool ret;
+
+	if (t_matches(pattern, topic, &ret) != MOSQ_ERR_SUCCESS) {
+		LOG(MOSQ_LOG_ERR, "invalid topic '%s'", pattern);
+	} else if (ret && (access & rule_access) != 0) {
+		if (rule != NULL)
+			*rule = strdup(pattern);
+		return BACKEND_ALLOW;
+	}
+	return BACKEND_DEFER;
+}
+
+static int do_aclcheck(dllist * acl_list,
+		           const char *clientid,
+		           const char *username,
+		           const char *topic,
+		           int access,
+		           char **rule)
+{
+	char buf[512];
+	acl_entry *acl;
+
+	dllist_for_each_element(acl_list, acl, entry) {
+		expand_topic(acl->topic, clientid, username, buf, sizeof(buf));
+		if (match_rule(buf, acl->access, topic, access, rule) == BACKEND_ALLOW)
 			return BACKEND_ALLOW;
+	}
+	return BACKEND_DEFER;
+}
+
+/*
+ * As do_aclcheck(), for a run of rules in a compiled image; rules without
+ * %c or %u are matched in place.
+ */
+static int do_aclcheck_image(const struct fimage *fi,
+			     uint32_t first,
+			     uint32_t count,
+			     const char *clientid,
+			     const char *username,
+			     const char *topic,
+			     int access,
+			     char **rule)
+{
+	char buf[512];
+	const struct fi_rule *r;
+	const char *pattern;
+	int acc;
+
+	for (r = &fi->rules[first]; r < &fi->rules[first + count]; r++) {
+		pattern = fimage_str(fi, r->topic);
+		if (r->flags & FI_EXPAND) {
+			expand_topic(pattern, clientid, username, buf, sizeof(buf));
+			pattern = buf;
 		}
+		acc = ((r->access & FI_READ) ? MOSQ_ACL_READ : 0) |
+		      ((r->access & FI_WRITE) ? MOSQ_ACL_WRITE : 0);
+		if (match_rule(pattern, acc, topic, access, rule) == BACKEND_ALLOW)
+			return BACKEND_ALLOW;
 	}
 	return BACKEND_DEFER;
 }
@@ -406,25 +882,55 @@ int be_files_aclcheck(void *handle,
 		          const char *topic,
 		          int access)
 {
-	be_files *const conf = (be_files *) handle;
-	pwd_entry *pwd = find_pwd(conf, username);
+	return be_files_aclcheck_rule(handle, clientid, username, topic, access, NULL);
+}
+
+int be_files_aclcheck_rule(void *handle,
+		               const char *clientid,
+		               const char *username,
+		               const char *topic,
+		               int access,
+		               char **rule)
+{
+	files_data *const conf = current((be_files *) handle);
+	pwd_entry *pwd;
 	int ret = 0;
 
 	if (!conf->acl_checks)
 		return BACKEND_ALLOW;
 
+	if (conf->image) {
+		const struct fimage *fi = conf->image;
+		const struct fi_user *u = fimage_user(fi, username);
+
+		ret = BACKEND_DEFER;
+		if (u != NULL)
+			ret = do_aclcheck_image(fi, u->rule_first, u->rule_count, clientid, username, topic, access, rule);
+		if (ret == BACKEND_DEFER)
+			ret = do_aclcheck_image(fi, fi->hdr->global_first, fi->hdr->global_count, clientid, username, topic, access, rule);
+		return ret;
+	}
+
+	pwd = find_pwd(conf, username);
 	if (pwd != NULL) {
-		ret = do_aclcheck(&pwd->acl_entries, clientid, username, topic, access);
+		ret = do_aclcheck(&pwd->acl_entries, clientid, username, topic, access, rule);
 	}
 
 	if (ret == BACKEND_DEFER)
-		ret = do_aclcheck(&acl_entries, clientid, username, topic, access);
+		ret = do_aclcheck(&conf->acl_entries, clientid, username, topic, access, rule);
 	return ret;
 }
 
 int be_files_aclpatterns_available(void)
 {
-	return !dllist_empty(&acl_entries);
+	files_data *data;
+
+	if (patterns_conf == NULL)
+		return 0;
+	data = current(patterns_conf);
+	if (data->image)
+		return data->image->hdr->global_count > 0;
+	return !dllist_empty(&data->acl_entries);
 }
 
 int be_files_aclpatterns_check(const char *clientid,
@@ -432,7 +938,15 @@ int be_files_aclpatterns_check(const char *clientid,
 			           const char *topic,
 			           int access)
 {
-	return do_aclcheck(&acl_entries, clientid, username, topic, access);
+	files_data *data;
+
+	if (patterns_conf == NULL)
+		return BACKEND_DEFER;
+	data = current(patterns_conf);
+	if (data->image)
+		return do_aclcheck_image(data->image, data->image->hdr->global_first,
+			data->image->hdr->global_count, clientid, username, topic, access, NULL);
+	return do_aclcheck(&data->acl_entries, clientid, username, topic, access, NULL);
 }
 
 #endif	/* // BE_FILES */
@@ -34,6 +34,7 @@ void be_files_destroy(void *handle);
 int be_files_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid);
 int be_files_superuser(void *handle, const char *username);
 int be_files_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int access);
+int be_files_aclcheck_rule(void *handle, const char *clientid, const char *username, const char *topic, int access, char **rule);
 
 int be_files_aclpatterns_available(void);
 int be_files_aclpatterns_check(const char *clientid, const char *username, const char *topic, int access);
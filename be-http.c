@@ -36,6 +36,7 @@
 #include "hash.h"
 #include "log.h"
 #include "envs.h"
+#include "arena.h"
 #include <curl/curl.h>
 
 static int get_string_envs(CURL *curl, const char *required_env, char *querystring)
@@ -52,12 +53,11 @@ static int get_string_envs(CURL *curl, const char *required_env, char *querystri
 
 	//_log(LOG_DEBUG, "sys_envs=%s", sys_envs);
 
-	env_string = (char *)malloc( strlen(required_env) + 20);
+	env_string = arena_strdup(be_arena, required_env);
 	if (env_string == NULL) {
 		_fatal("ENOMEM");
 		return (-1);
 	}
-	sprintf(env_string, "%s", required_env);
 
 	//_log(LOG_DEBUG, "env_string=%s", env_string);
 
@@ -71,25 +71,20 @@ static int get_string_envs(CURL *curl, const char *required_env, char *querystri
 		//_log(LOG_DEBUG, "escaped_key=%s", escaped_key);
 		//_log(LOG_DEBUG, "escaped_val=%s", escaped_envvalue);
 
-		data = (char *)malloc(strlen(escaped_key) + strlen(escaped_val) + 4);
+		data = arena_sprintf(be_arena, "%s=%s&", escaped_key, escaped_val);
 		if ( data == NULL ) {
 			_fatal("ENOMEM");
 			return (-1);
 		}
-		sprintf(data, "%s=%s&", escaped_key, escaped_val);
 		if ( i == 0 ) {
 			sprintf(querystring, "%s", data);
 		} else {
 			strcat(querystring, data);
 		}
-		free(data);
 		curl_free(escaped_key);
 		curl_free(escaped_val);
 	}
 
-	if (escaped_key) free(escaped_key);
-	if (escaped_val) free(escaped_val);
-	free(env_string);
 	return (num);
 }
 
@@ -127,7 +122,7 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 	//_log(LOG_NOTICE, "u=%s p=%s t=%s acc=%d", username, password, topic, acc);
 
 	urllen = strlen(conf->hostname) + strlen(uri) + 20;
-	url = (char *)malloc(urllen);
+	url = (char *)arena_alloc(be_arena, urllen);
 	if (url == NULL) {
 		_fatal("ENOMEM");
 		return BACKEND_ERROR;
@@ -148,7 +143,7 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 	char string_acc[20];
 	snprintf(string_acc, 20, "%d", acc);
 
-	char *string_envs = (char *)malloc(MAXPARAMSLEN);
+	char *string_envs = (char *)arena_alloc(be_arena, MAXPARAMSLEN);
 	if (string_envs == NULL) {
 		_fatal("ENOMEM");
 		return BACKEND_ERROR;
@@ -170,18 +165,17 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 	}
 	//---- over ----
 
-	data = (char *)malloc(strlen(string_envs) + strlen(escaped_username) + strlen(escaped_password) + strlen(escaped_topic) + strlen(string_acc) + strlen(escaped_clientid) + 50);
-	if (data == NULL) {
-		_fatal("ENOMEM");
-		return BACKEND_ERROR;
-	}
-	sprintf(data, "%susername=%s&password=%s&topic=%s&acc=%s&clientid=%s",
+	data = arena_sprintf(be_arena, "%susername=%s&password=%s&topic=%s&acc=%s&clientid=%s",
 		string_envs,
 		escaped_username,
 		escaped_password,
 		escaped_topic,
 		string_acc,
 		clientid);
+	if (data == NULL) {
+		_fatal("ENOMEM");
+		return BACKEND_ERROR;
+	}
 
 	_log(LOG_DEBUG, "url=%s", url);
 	_log(LOG_DEBUG, "data=%s", data);
@@ -213,9 +207,6 @@ static int http_post(void *handle, char *uri, const char *clientid, const char *
 
 	curl_easy_cleanup(curl);
 	curl_slist_free_all (headerlist);
-	free(url);
-	free(data);
-	free(string_envs);
 	free(escaped_username);
 	free(escaped_password);
 	free(escaped_topic);
@@ -33,23 +33,79 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <poll.h>
 #include <mosquitto.h>
+#include <errmsg.h>
 #include "be-mysql.h"
 #include "log.h"
 #include "hash.h"
 #include "backends.h"
+#include "arena.h"
 
-struct mysql_backend {
+#ifndef ER_UNKNOWN_STMT_HANDLER
+# define ER_UNKNOWN_STMT_HANDLER	(1243)	/* statement lost with the connection */
+#endif
+
+#define MAXPARAMS	(4)		/* placeholders in one query */
+#define RESULTSIZE	(256)		/* initial buffer for a column */
+#define MAXCONNS	(2)		/* with mysql_nonblocking */
+
+enum { Q_USER, Q_SUPER, Q_ACL, NQUERIES };
+
+/*
+ * A configured query, turned into a statement with `?' placeholders in
+ * place of its printf-style conversions. kinds[i] is the conversion
+ * ('s' or 'd') the i-th placeholder replaced, which tells how to bind
+ * the i-th argument.
+ */
+
+struct mysql_query {
+	char *sql;
+	char kinds[MAXPARAMS];
+	int nparams;
+};
+
+/* An argument to a query; which member is used depends on the kind */
+struct mysql_arg {
+	const char *s;
+	int d;
+};
+
+/*
+ * A connection to the server, with the queries prepared on it once per
+ * session.
+ */
+
+struct mysql_conn {
 	MYSQL *mysql;
+	unsigned long thread_id;	/* session the statements were prepared on */
+	time_t last_used;
+	unsigned int error;		/* of the last failed prepare */
+	MYSQL_STMT *stmts[NQUERIES];
+};
+
+struct mysql_backend {
+	struct mysql_conn conns[MAXCONNS];
+	int nconns;
 	char *host;
 	int port;	
 	char *dbname;
 	char *user;
 	char *pass;
+	bool ssl_enabled;
+	char *ssl_key, *ssl_cert, *ssl_ca, *ssl_capath, *ssl_cipher;
 	bool auto_connect;
-	char *userquery; //MUST return 1 row, 1 column
-	char *superquery; //MUST return 1 row, 1 column,[0, 1]
-	char *aclquery; //MAY return n rows, 1 column, string
+	my_bool reconnect;		/* MYSQL_OPT_RECONNECT */
+	bool nonblocking;
+	int ping_idle;			/* ping first after that many idle seconds */
+	unsigned int connect_timeout;	/* seconds, 0 for the library default */
+	unsigned int read_timeout;
+	unsigned int write_timeout;
+	struct mysql_query queries[NQUERIES];
+	/* Q_USER MUST return 1 row, 1 column */
+	/* Q_SUPER MUST return 1 row, 1 column,[0, 1] */
+	/* Q_ACL MAY return n rows, 1 column, string */
 };
 
 static char *get_bool(char *option, char *defval)
@@ -63,83 +119,402 @@ static char *get_bool(char *option, char *defval)
 	return defval;
 }
 
+/*
+ * Turn the printf-style query `fmt' (as configured in `option') into a
+ * statement: each %s, with any quotes around it, and each %d becomes a
+ * `?'. Other conversions, and a %s inside a longer string literal (which
+ * would leave the `?' quoted), are configuration errors.
+ */
+
+static void query_compile(struct mysql_query *q, const char *option, const char *fmt)
+{
+	const char *f;
+	char *sql, *opening = NULL, quote = 0;
+
+	memset(q, 0, sizeof(struct mysql_query));
+	if (fmt == NULL)
+		return;
+	if ((q->sql = sql = malloc(strlen(fmt) + 1)) == NULL)
+		_fatal("Out of memory");
+
+	for (f = fmt; *f; f++) {
+		if (*f != '%') {
+			if (quote && *f == '\\' && f[1]) {
+				*sql++ = *f++;
+			} else if (*f == quote) {
+				quote = 0;
+			} else if (!quote && (*f == '\'' || *f == '"')) {
+				quote = *f;
+				opening = sql;
+			}
+			*sql++ = *f;
+			continue;
+		}
+		if (f[1] == '%') {
+			*sql++ = *++f;
+			continue;
+		}
+		if ((f[1] != 's' && f[1] != 'd') || q->nparams == MAXPARAMS)
+			_fatal("Option `%s': only up to %d %%s and %%d are supported", option, MAXPARAMS);
+		q->kinds[q->nparams++] = *++f;
+		if (quote && sql - 1 == opening && f[1] == quote) {
+			sql--;		/* a bound value needs no quotes */
+			f++;
+			quote = 0;
+		} else if (quote) {
+			_fatal("Option `%s': %%%c can't be part of a string; write it unquoted, e.g. CONCAT(%%%c, '%%%%')",
+				option, *f, *f);
+		}
+		*sql++ = '?';
+	}
+	*sql = 0;
+}
+
+static void conn_close_stmts(struct mysql_conn *c)
+{
+	int i;
+
+	for (i = 0; i < NQUERIES; i++) {
+		if (c->stmts[i]) {
+			mysql_stmt_close(c->stmts[i]);
+			c->stmts[i] = NULL;
+		}
+	}
+}
+
+/*
+ * Statements belong to a session, so prepare them again when we're on a
+ * new one, e.g. after MYSQL_OPT_RECONNECT kicked in.
+ */
+
+static bool statements_ready(struct mysql_backend *conf, struct mysql_conn *c)
+{
+	unsigned long id = mysql_thread_id(c->mysql);
+	int i;
+
+	for (i = 0; i < NQUERIES; i++) {
+		if (conf->queries[i].sql && c->stmts[i] == NULL)
+			break;
+	}
+	if (id == c->thread_id && id != 0 && i == NQUERIES)
+		return true;
+
+	conn_close_stmts(c);
+	c->thread_id = id;
+	c->error = 0;
+	for (i = 0; i < NQUERIES; i++) {
+		const char *sql = conf->queries[i].sql;
+
+		if (sql == NULL)
+			continue;
+		if ((c->stmts[i] = mysql_stmt_init(c->mysql)) == NULL) {
+			c->error = mysql_errno(c->mysql);
+			return false;
+		}
+		if (mysql_stmt_prepare(c->stmts[i], sql, strlen(sql)) != 0) {
+			_log(LOG_NOTICE, "mysql: can't prepare %s: %s", sql, mysql_stmt_error(c->stmts[i]));
+			c->error = mysql_stmt_errno(c->stmts[i]);
+			conn_close_stmts(c);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool conn_open(struct mysql_backend *conf, struct mysql_conn *c)
+{
+	if ((c->mysql = mysql_init(NULL)) == NULL)
+		return false;
+	if (conf->ssl_enabled) {
+		mysql_ssl_set(c->mysql, conf->ssl_key, conf->ssl_cert, conf->ssl_ca, conf->ssl_capath, conf->ssl_cipher);
+	}
+	if (conf->reconnect) {
+		mysql_options(c->mysql, MYSQL_OPT_RECONNECT, &conf->reconnect);
+	}
+#ifdef MYSQL_NONBLOCKING
+	if (conf->nonblocking) {
+		mysql_options(c->mysql, MYSQL_OPT_NONBLOCK, 0);
+	}
+#endif
+	if (conf->connect_timeout) {
+		mysql_options(c->mysql, MYSQL_OPT_CONNECT_TIMEOUT, &conf->connect_timeout);
+	}
+	if (conf->read_timeout) {
+		mysql_options(c->mysql, MYSQL_OPT_READ_TIMEOUT, &conf->read_timeout);
+	}
+	if (conf->write_timeout) {
+		mysql_options(c->mysql, MYSQL_OPT_WRITE_TIMEOUT, &conf->write_timeout);
+	}
+	if (!mysql_real_connect(c->mysql, conf->host, conf->user, conf->pass, conf->dbname, conf->port, NULL, 0)) {
+		_log(LOG_NOTICE, "%s", mysql_error(c->mysql));
+		return false;
+	}
+	return statements_ready(conf, c);
+}
+
+static bool auto_connect(struct mysql_backend *conf, struct mysql_conn *c)
+{
+	if (conf->auto_connect) {
+		if (!mysql_real_connect(c->mysql, conf->host, conf->user, conf->pass, conf->dbname, conf->port, NULL, 0)) {
+			fprintf(stderr, "do auto_connect but %s\n", mysql_error(c->mysql));
+			return false;
+		}
+		return true;
+	}
+	return false;
+}
+
+/*
+ * The connection is assumed to be alive: queries are just run, and only
+ * when one fails because the server went away do we reconnect (via
+ * MYSQL_OPT_RECONNECT, which mysql_ping() triggers, or auto_connect) and
+ * try it once more. Optionally, a connection idle for `mysql_ping_idle'
+ * seconds, which a server or firewall may have dropped meanwhile, is
+ * pinged first.
+ */
+
+static bool gone(unsigned int err)
+{
+	return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST ||
+		err == ER_UNKNOWN_STMT_HANDLER;
+}
+
+static bool reconnect(struct mysql_backend *conf, struct mysql_conn *c)
+{
+	if (mysql_ping(c->mysql) == 0 || auto_connect(conf, c))
+		return statements_ready(conf, c);
+	_log(LOG_NOTICE, "mysql: %s", mysql_error(c->mysql));
+	return false;
+}
+
+/*
+ * A handle which never connected (the server was down at startup), or
+ * whose statements can't be prepared for want of a connection, is
+ * reconnected whatever `mysql_ping_idle' says.
+ */
+
+static bool connected(struct mysql_backend *conf, struct mysql_conn *c)
+{
+	if (c->mysql == NULL)
+		return false;
+	if (mysql_thread_id(c->mysql) == 0 ||
+	    (conf->ping_idle > 0 && time(NULL) - c->last_used >= conf->ping_idle))
+		return reconnect(conf, c);
+	if (statements_ready(conf, c))
+		return true;
+	if (gone(c->error) || (c->error >= CR_MIN_ERROR && c->error <= CR_MAX_ERROR))
+		return reconnect(conf, c);
+	return false;
+}
+
+/*
+ * A read that timed out also shows as a lost connection; retrying it
+ * would double the time the broker waits, so don't.
+ */
+
+static bool timed_out(struct mysql_backend *conf, time_t start)
+{
+	return conf->read_timeout && time(NULL) - start >= conf->read_timeout;
+}
+
+/*
+ * Fill `params' to bind `args' to the placeholders of query `q'.
+ */
+
+static void params_bind(const struct mysql_query *q, struct mysql_arg *args, int nargs,
+			MYSQL_BIND *params, unsigned long *lengths)
+{
+	static struct mysql_arg none = { "", 0 };
+	struct mysql_arg *a;
+	int i;
+
+	memset(params, 0, MAXPARAMS * sizeof(MYSQL_BIND));
+	for (i = 0; i < q->nparams; i++) {
+		a = (i < nargs) ? &args[i] : &none;
+		if (q->kinds[i] == 'd') {
+			params[i].buffer_type = MYSQL_TYPE_LONG;
+			params[i].buffer = &a->d;
+		} else {
+			const char *v = a->s ? a->s : "";
+
+			lengths[i] = strlen(v);
+			params[i].buffer_type = MYSQL_TYPE_STRING;
+			params[i].buffer = (void *)v;
+			params[i].buffer_length = lengths[i];
+			params[i].length = &lengths[i];
+		}
+	}
+}
+
+static bool result_bind(MYSQL_BIND *res, unsigned long *length, my_bool *is_null)
+{
+	memset(res, 0, sizeof(MYSQL_BIND));
+	res->buffer_type = MYSQL_TYPE_STRING;
+	if ((res->buffer = arena_alloc(be_arena, RESULTSIZE)) == NULL)
+		return false;
+	res->buffer_length = RESULTSIZE - 1;	/* room for the NUL */
+	res->length = length;
+	res->is_null = is_null;
+	return true;
+}
+
+/*
+ * Execute query `qi' on `c' with `args' bound to its placeholders, once
+ * more on a new session if the server has gone away. The result has a
+ * single string column, which is bound to `res'. Returns the statement,
+ * or NULL on error.
+ */
+
+static MYSQL_STMT *query_execute(struct mysql_backend *conf, struct mysql_conn *c, int qi, struct mysql_arg *args, int nargs, MYSQL_BIND *res)
+{
+	MYSQL_BIND params[MAXPARAMS];
+	unsigned long lengths[MAXPARAMS];
+	MYSQL_STMT *stmt;
+	time_t start = time(NULL);
+	bool retry;
+
+	params_bind(&conf->queries[qi], args, nargs, params, lengths);
+
+	for (retry = true; ; retry = false) {
+		stmt = c->stmts[qi];
+		if (mysql_stmt_bind_param(stmt, params) == 0 &&
+		    mysql_stmt_execute(stmt) == 0)
+			break;
+		if (!retry || !gone(mysql_stmt_errno(stmt)) || timed_out(conf, start)) {
+			_log(LOG_NOTICE, "mysql: %s", mysql_stmt_error(stmt));
+			return NULL;
+		}
+		_log(LOG_DEBUG, "mysql: %s; reconnecting", mysql_stmt_error(stmt));
+		if (!reconnect(conf, c))
+			return NULL;
+	}
+
+	if (mysql_stmt_field_count(stmt) != 1 ||
+	    mysql_stmt_bind_result(stmt, res)) {
+		_log(LOG_NOTICE, "mysql: %s", mysql_stmt_error(stmt));
+		mysql_stmt_free_result(stmt);
+		return NULL;
+	}
+	c->last_used = time(NULL);
+	return stmt;
+}
+
+/*
+ * Fetch the next row into `res', or into a buffer in the arena if the
+ * column doesn't fit. Returns 1 with a string (NULL for SQL NULL) in
+ * `*value', 0 at the end, or -1 on error.
+ */
+
+static int query_fetch(MYSQL_STMT *stmt, MYSQL_BIND *res, char **value)
+{
+	int rc = mysql_stmt_fetch(stmt);
+
+	if (rc == MYSQL_NO_DATA)
+		return 0;
+	if (rc == MYSQL_DATA_TRUNCATED && !*res->is_null) {
+		/* `res' stays bound for the next rows; read this one aside */
+		MYSQL_BIND col = *res;
+		unsigned long len = *res->length;
+
+		if ((col.buffer = arena_alloc(be_arena, len + 1)) == NULL)
+			return -1;
+		col.buffer_length = len + 1;
+		if (mysql_stmt_fetch_column(stmt, &col, 0, 0) != 0)
+			return -1;
+		*value = col.buffer;
+		(*value)[len] = 0;
+		return 1;
+	} else if (rc != 0 && rc != MYSQL_DATA_TRUNCATED) {
+		_log(LOG_NOTICE, "mysql: %s", mysql_stmt_error(stmt));
+		return -1;
+	}
+	if (*res->is_null) {
+		*value = NULL;
+	} else {
+		*value = res->buffer;
+		(*value)[*res->length] = 0;
+	}
+	return 1;
+}
+
 void *be_mysql_init()
 {
 	struct mysql_backend *conf;
-	char *host, *user, *pass, *dbname, *p;
-	char *ssl_ca, *ssl_capath, *ssl_cert, *ssl_cipher, *ssl_key;
+	char *host, *p;
 	char *userquery;
 	char *opt_flag;
-	int port;
-	bool ssl_enabled;	
-	my_bool reconnect = false;
-	
+	int i;
 
 	_log(LOG_DEBUG, "}}}} MYSQL");
 
+	userquery = p_stab("userquery");
+
+	if (!userquery) {
+		_fatal("Mandatory option 'userquery' is missing");
+		return (NULL);
+	}
+	if ((conf = (struct mysql_backend *)calloc(1, sizeof(struct mysql_backend))) == NULL)
+		return (NULL);
+
 	host = p_stab("host");
 	p = p_stab("port");
-	user = p_stab("user");
-	pass = p_stab("pass");
-	dbname = p_stab("dbname");
-	
+	conf->host = (host) ? host : strdup("localhost");
+	conf->port = (!p) ? 3306 : atoi(p);
+	conf->user = p_stab("user");
+	conf->pass = p_stab("pass");
+	conf->dbname = p_stab("dbname");
+
 	opt_flag = get_bool("ssl_enabled", "false");
 	if (!strcmp("true", opt_flag)) {
-		ssl_enabled = true;
+		conf->ssl_enabled = true;
 		_log(LOG_DEBUG, "SSL is enabled");
 	}
 	else{
-		ssl_enabled = false;
+		conf->ssl_enabled = false;
 		_log(LOG_DEBUG, "SSL is disabled");
 	}
 
-	ssl_key = p_stab("ssl_key");	
-	ssl_cert = p_stab("ssl_cert");
-	ssl_ca = p_stab("ssl_ca");
-	ssl_capath = p_stab("ssl_capath");
-	ssl_cipher = p_stab("ssl_cipher");
-		
-	host = (host) ? host : strdup("localhost");
-	port = (!p) ? 3306 : atoi(p);
+	conf->ssl_key = p_stab("ssl_key");	
+	conf->ssl_cert = p_stab("ssl_cert");
+	conf->ssl_ca = p_stab("ssl_ca");
+	conf->ssl_capath = p_stab("ssl_capath");
+	conf->ssl_cipher = p_stab("ssl_cipher");
 
-	userquery = p_stab("userquery");
+	query_compile(&conf->queries[Q_USER], "userquery", userquery);
+	query_compile(&conf->queries[Q_SUPER], "superquery", p_stab("superquery"));
+	query_compile(&conf->queries[Q_ACL], "aclquery", p_stab("aclquery"));
 
-	if (!userquery) {
-		_fatal("Mandatory option 'userquery' is missing");
-		return (NULL);
-	}
-	if ((conf = (struct mysql_backend *)malloc(sizeof(struct mysql_backend))) == NULL)
-		return (NULL);
-
-	conf->mysql = mysql_init(NULL);
-	conf->host = host;
-	conf->port = port;
-	conf->user = user;
-	conf->pass = pass;
-	conf->auto_connect = false;
-	conf->dbname = dbname;
-	conf->userquery = userquery;
-	conf->superquery = p_stab("superquery");
-	conf->aclquery = p_stab("aclquery");
-
-	if(ssl_enabled){
-		mysql_ssl_set(conf->mysql, ssl_key, ssl_cert, ssl_ca, ssl_capath, ssl_cipher);
-	}
-	
 	opt_flag = get_bool("mysql_auto_connect", "true");
 	if (!strcmp("true", opt_flag)) {
 		conf->auto_connect = true;
 	}
+	if ((p = p_stab("mysql_ping_idle")) != NULL)
+		conf->ping_idle = atoi(p);
+	if ((p = p_stab("mysql_connect_timeout")) != NULL)
+		conf->connect_timeout = atoi(p);
+	if ((p = p_stab("mysql_read_timeout")) != NULL)
+		conf->read_timeout = atoi(p);
+	if ((p = p_stab("mysql_write_timeout")) != NULL)
+		conf->write_timeout = atoi(p);
 	opt_flag = get_bool("mysql_opt_reconnect", "true");
 	if (!strcmp("true", opt_flag)) {
-		reconnect = true;
-		mysql_options(conf->mysql, MYSQL_OPT_RECONNECT, &reconnect);
-	}
-	if (!mysql_real_connect(conf->mysql, host, user, pass, dbname, port, NULL, 0)) {
-		_log(LOG_NOTICE, "%s", mysql_error(conf->mysql));
-		if (!conf->auto_connect && !reconnect) {
-			free(conf);
-			mysql_close(conf->mysql);
+		conf->reconnect = true;
+	}
+
+	conf->nconns = 1;
+	opt_flag = get_bool("mysql_nonblocking", "false");
+	if (!strcmp("true", opt_flag)) {
+#ifdef MYSQL_NONBLOCKING
+		conf->nonblocking = true;
+		conf->nconns = MAXCONNS;
+#else
+		_log(LOG_NOTICE, "WARN: mysql_nonblocking needs the MariaDB client library; ignored");
+#endif
+	}
+
+	for (i = 0; i < conf->nconns; i++) {
+		if (!conn_open(conf, &conf->conns[i]) && !conf->auto_connect && !conf->reconnect) {
+			be_mysql_destroy(conf);
 			return (NULL);
 		}
 	}
@@ -149,98 +524,70 @@ void *be_mysql_init()
 void be_mysql_destroy(void *handle)
 {
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
+	int i;
 
 	if (conf) {
-		mysql_close(conf->mysql);
-		if (conf->userquery)
-			free(conf->userquery);
-		if (conf->superquery)
-			free(conf->superquery);
-		if (conf->aclquery)
-			free(conf->aclquery);
-		free(conf);
-	}
-}
-
-static char *escape(void *handle, const char *value, long *vlen)
-{
-	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *v;
-
-	*vlen = strlen(value) * 2 + 1;
-	if ((v = malloc(*vlen)) == NULL)
-		return (NULL);
-	mysql_real_escape_string(conf->mysql, v, value, strlen(value));
-	return (v);
-}
-
-static bool auto_connect(struct mysql_backend *conf)
-{
-	if (conf->auto_connect) {
-		if (!mysql_real_connect(conf->mysql, conf->host, conf->user, conf->pass, conf->dbname, conf->port, NULL, 0)) {
-			fprintf(stderr, "do auto_connect but %s\n", mysql_error(conf->mysql));
-			return false;
+		for (i = 0; i < MAXCONNS; i++) {
+			conn_close_stmts(&conf->conns[i]);
+			if (conf->conns[i].mysql)
+				mysql_close(conf->conns[i].mysql);
 		}
-		return true;
+		for (i = 0; i < NQUERIES; i++)
+			free(conf->queries[i].sql);
+		free(conf);
 	}
-	return false;
 }
 
 int be_mysql_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
 {
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *query = NULL, *u = NULL, *value = NULL, *v;
-	long nrows, ulen;
-	MYSQL_RES *res = NULL;
-	MYSQL_ROW rowdata;
-
-	// fprintf(stderr, "------>%s<-----\n", clientid);
-	if (!conf || !conf->userquery || !username || !*username)
+	struct mysql_conn *c;
+	struct mysql_arg args[2] = { { username, 0 }, { clientid, 0 } };
+	char *value = NULL, *v;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND res;
+	unsigned long length;
+	my_bool is_null;
+
+	if (!conf || !conf->queries[Q_USER].sql || !username || !*username)
 		return BACKEND_DEFER;
 
-	if (mysql_ping(conf->mysql)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		if (!auto_connect(conf)) {
-			return BACKEND_ERROR;
-		}
-	}
-	if ((u = escape(conf, username, &ulen)) == NULL)
+	c = &conf->conns[0];
+	if (!connected(conf, c))
+		return BACKEND_ERROR;
+	if (!result_bind(&res, &length, &is_null))
 		return BACKEND_ERROR;
 
-	if ((query = malloc(strlen(conf->userquery) + ulen + 128)) == NULL) {
-		free(u);
+	if ((stmt = query_execute(conf, c, Q_USER, args, 2, &res)) == NULL)
 		return BACKEND_ERROR;
-	}
-	sprintf(query, conf->userquery, u, clientid);
-	free(u);
+	/* Exactly one row, else the user is not found */
+	if (query_fetch(stmt, &res, &v) == 1 && v != NULL) {
+		char *second;
 
-	if (mysql_query(conf->mysql, query)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		goto out;
-	}
-	res = mysql_store_result(conf->mysql);
-	if ((nrows = mysql_num_rows(res)) != 1) {
-		//DEBUG fprintf(stderr, "rowcount = %ld; not ok\n", nrows);
-		goto out;
-	}
-	if (mysql_num_fields(res) != 1) {
-		//DEBUG fprintf(stderr, "numfields not ok\n");
-		goto out;
-	}
-	if ((rowdata = mysql_fetch_row(res)) == NULL) {
-		goto out;
+		if ((value = strdup(v)) != NULL && query_fetch(stmt, &res, &second) != 0) {
+			free(value);
+			value = NULL;
+		}
 	}
-	v = rowdata[0];
-	value = (v) ? strdup(v) : NULL;
+	mysql_stmt_free_result(stmt);
 
+	*phash = value;
+	return BACKEND_DEFER;
+}
 
-out:
+/*
+ * Superuser flag from the executed superquery.
+ */
 
-	mysql_free_result(res);
-	free(query);
+static int super_rows(MYSQL_STMT *stmt, MYSQL_BIND *res)
+{
+	int issuper = BACKEND_DEFER;
+	char *v;
 
-	*phash = value;
-	return BACKEND_DEFER;
+	if (query_fetch(stmt, res, &v) == 1 && v != NULL)
+		issuper = (atoi(v)) ? BACKEND_ALLOW: BACKEND_DEFER;
+	mysql_stmt_free_result(stmt);
+	return (issuper);
 }
 
 /*
@@ -250,56 +597,63 @@ out:
 int be_mysql_superuser(void *handle, const char *username)
 {
 	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *query = NULL, *u = NULL;
-	long nrows, ulen;
-	int issuper = BACKEND_DEFER;
-	MYSQL_RES *res = NULL;
-	MYSQL_ROW rowdata;
-
-
-	if (!conf || !conf->superquery)
+	struct mysql_conn *c;
+	struct mysql_arg args[1] = { { username, 0 } };
+	MYSQL_STMT *stmt;
+	MYSQL_BIND res;
+	unsigned long length;
+	my_bool is_null;
+
+	if (!conf || !conf->queries[Q_SUPER].sql)
 		return BACKEND_DEFER;
 
-	if (mysql_ping(conf->mysql)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		if (!auto_connect(conf)) {
-			return (BACKEND_ERROR);
-		}
-	}
-	if ((u = escape(conf, username, &ulen)) == NULL)
+	c = &conf->conns[0];
+	if (!connected(conf, c))
+		return (BACKEND_ERROR);
+	if (!result_bind(&res, &length, &is_null))
 		return (BACKEND_ERROR);
 
-	if ((query = malloc(strlen(conf->superquery) + ulen + 128)) == NULL) {
-		free(u);
+	if ((stmt = query_execute(conf, c, Q_SUPER, args, 1, &res)) == NULL)
 		return (BACKEND_ERROR);
-	}
-	sprintf(query, conf->superquery, u);
-	free(u);
+	return (super_rows(stmt, &res));
+}
 
-	if (mysql_query(conf->mysql, query)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		issuper = BACKEND_ERROR;
-		goto out;
-	}
-	res = mysql_store_result(conf->mysql);
-	if ((nrows = mysql_num_rows(res)) != 1) {
-		goto out;
-	}
-	if (mysql_num_fields(res) != 1) {
-		//DEBUG fprintf(stderr, "numfields not ok\n");
-		goto out;
-	}
-	if ((rowdata = mysql_fetch_row(res)) == NULL) {
-		goto out;
-	}
-	issuper = (atoi(rowdata[0])) ? BACKEND_ALLOW: BACKEND_DEFER;
+/*
+ * Match `topic' against the topic filters returned by the executed
+ * aclquery. Rows are matched as they arrive; no need to buffer the whole
+ * set.
+ */
 
-out:
+static int acl_rows(MYSQL_STMT *stmt, MYSQL_BIND *res, const char *clientid, const char *username, const char *topic, char **rule)
+{
+	int match = BACKEND_DEFER;
+	char *v;
+	bool bf;
 
-	mysql_free_result(res);
-	free(query);
+	while (match == 0 && query_fetch(stmt, res, &v) == 1) {
+		if (v != NULL) {
 
-	return (issuper);
+			/*
+			 * Check mosquitto_match_topic. If true, if true, set
+			 * match and break out of loop.
+			 */
+
+			char *expanded;
+
+			expanded = t_expand_arena(be_arena, clientid, username, v);
+			if (expanded && *expanded) {
+				t_matches(expanded, topic, &bf);
+				if (bf) match = BACKEND_ALLOW;
+				_log(LOG_DEBUG, "  mysql: topic_matches(%s, %s) == %d",
+				     expanded, v, bf);
+
+				if (bf && rule)
+					*rule = strdup(expanded);
+			}
+		}
+	}
+	mysql_stmt_free_result(stmt);
+	return (match);
 }
 
 /*
@@ -311,76 +665,210 @@ out:
  * SELECT topic FROM table WHERE username = '%s' AND (acc & %d)		//
  * may user SUB or PUB topic? SELECT topic FROM table WHERE username = '%s'
  * / ignore ACC
+ *
+ * If `rule' is not NULL it receives the expanded topic filter which matched.
  */
 
 int be_mysql_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
-	struct mysql_backend *conf = (struct mysql_backend *)handle;
-	char *query = NULL, *u = NULL, *v;
-	long ulen;
-	int match = BACKEND_DEFER;
-	bool bf;
-	MYSQL_RES *res = NULL;
-	MYSQL_ROW rowdata;
+	return be_mysql_aclcheck_rule(handle, clientid, username, topic, acc, NULL);
+}
 
-	if (!conf || !conf->aclquery)
+int be_mysql_aclcheck_rule(void *handle, const char *clientid, const char *username, const char *topic, int acc, char **rule)
+{
+	struct mysql_backend *conf = (struct mysql_backend *)handle;
+	struct mysql_conn *c;
+	struct mysql_arg args[2] = { { username, 0 }, { NULL, acc } };
+	MYSQL_STMT *stmt;
+	MYSQL_BIND res;
+	unsigned long length;
+	my_bool is_null;
+
+	if (!conf || !conf->queries[Q_ACL].sql)
 		return BACKEND_DEFER;
 
-	if (mysql_ping(conf->mysql)) {
-		fprintf(stderr, "%s\n", mysql_error(conf->mysql));
-		if (!auto_connect(conf)) {
-			return (BACKEND_ERROR);
-		}
-	}
-	if ((u = escape(conf, username, &ulen)) == NULL)
+	c = &conf->conns[0];
+	if (!connected(conf, c))
+		return (BACKEND_ERROR);
+	if (!result_bind(&res, &length, &is_null))
 		return (BACKEND_ERROR);
 
-	if ((query = malloc(strlen(conf->aclquery) + ulen + 128)) == NULL) {
-		free(u);
+	if ((stmt = query_execute(conf, c, Q_ACL, args, 2, &res)) == NULL)
 		return (BACKEND_ERROR);
-	}
-	sprintf(query, conf->aclquery, u, acc);
-	free(u);
+	return (acl_rows(stmt, &res, clientid, username, topic, rule));
+}
 
-	//_log(LOG_DEBUG, "SQL: %s", query);
+#ifdef MYSQL_NONBLOCKING
+/*
+ * A statement executed with the non-blocking API: it is executed and its
+ * result transferred (mysql_stmt_store_result) while we wait on the
+ * sockets of all of them at once.
+ */
+
+struct nbquery {
+	struct mysql_conn *c;
+	MYSQL_STMT *stmt;
+	MYSQL_BIND params[MAXPARAMS];
+	unsigned long lengths[MAXPARAMS];
+	int phase;			/* 0: executing, 1: storing, 2: done */
+	int status;			/* MYSQL_WAIT_* we wait for */
+	int rc;
+};
 
-	if (mysql_query(conf->mysql, query)) {
-		_log(LOG_NOTICE, "%s", mysql_error(conf->mysql));
-		match = BACKEND_ERROR;
-		goto out;
+static void nb_next(struct nbquery *nb)
+{
+	while (nb->status == 0 && nb->phase < 2) {
+		if (nb->rc != 0) {
+			nb->phase = 2;
+		} else if (nb->phase++ == 0) {
+			nb->status = mysql_stmt_store_result_start(&nb->rc, nb->stmt);
+		}
 	}
-	res = mysql_store_result(conf->mysql);
-	if (mysql_num_fields(res) != 1) {
-		fprintf(stderr, "numfields not ok\n");
-		goto out;
+}
+
+static void nb_start(struct nbquery *nb, struct mysql_conn *c, const struct mysql_query *q, MYSQL_STMT *stmt, struct mysql_arg *args, int nargs)
+{
+	nb->c = c;
+	nb->stmt = stmt;
+	nb->phase = 0;
+	nb->rc = 0;
+	params_bind(q, args, nargs, nb->params, nb->lengths);
+	if (mysql_stmt_bind_param(stmt, nb->params)) {
+		nb->rc = 1;
+		nb->status = 0;
+	} else {
+		nb->status = mysql_stmt_execute_start(&nb->rc, stmt);
 	}
-	while (match == 0 && (rowdata = mysql_fetch_row(res)) != NULL) {
-		if ((v = rowdata[0]) != NULL) {
+	nb_next(nb);
+}
 
-			/*
-			 * Check mosquitto_match_topic. If true, if true, set
-			 * match and break out of loop.
-			 */
+/*
+ * Run the queries of `nb' until all are done, waiting for whichever
+ * connection is ready.
+ */
 
-			char *expanded;
+static void nb_run(struct nbquery *nb, int n)
+{
+	struct pollfd pfd[MAXCONNS];
+	int i, timeout, pending;
+
+	for (;;) {
+		timeout = -1;
+		for (i = pending = 0; i < n; i++) {
+			pfd[i].fd = -1;
+			pfd[i].events = pfd[i].revents = 0;
+			if (nb[i].phase == 2)
+				continue;
+			pending++;
+			pfd[i].fd = mysql_get_socket(nb[i].c->mysql);
+			if (nb[i].status & MYSQL_WAIT_READ)
+				pfd[i].events |= POLLIN;
+			if (nb[i].status & MYSQL_WAIT_WRITE)
+				pfd[i].events |= POLLOUT;
+			if (nb[i].status & MYSQL_WAIT_EXCEPT)
+				pfd[i].events |= POLLPRI;
+			if (nb[i].status & MYSQL_WAIT_TIMEOUT) {
+				int t = mysql_get_timeout_value_ms(nb[i].c->mysql);
+
+				if (timeout == -1 || t < timeout)
+					timeout = t;
+			}
+		}
+		if (pending == 0)
+			return;
+
+		if (poll(pfd, n, timeout) < 0)
+			continue;
+
+		for (i = 0; i < n; i++) {
+			int ready = 0;
+
+			if (nb[i].phase == 2)
+				continue;
+			if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+				ready |= MYSQL_WAIT_READ;
+			if (pfd[i].revents & POLLOUT)
+				ready |= MYSQL_WAIT_WRITE;
+			if (pfd[i].revents & POLLPRI)
+				ready |= MYSQL_WAIT_EXCEPT;
+			if (ready == 0 && (nb[i].status & MYSQL_WAIT_TIMEOUT))
+				ready = MYSQL_WAIT_TIMEOUT;
+			if (ready == 0)
+				continue;
+
+			nb[i].status = (nb[i].phase == 0) ?
+				mysql_stmt_execute_cont(&nb[i].rc, nb[i].stmt, ready) :
+				mysql_stmt_store_result_cont(&nb[i].rc, nb[i].stmt, ready);
+			nb_next(&nb[i]);
+		}
+	}
+}
+#endif /* MYSQL_NONBLOCKING */
 
-			t_expand(clientid, username, v, &expanded);
-			if (expanded && *expanded) {
-				mosquitto_topic_matches_sub(expanded, topic, &bf);
-				if (bf) match = BACKEND_ALLOW;
-				_log(LOG_DEBUG, "  mysql: topic_matches(%s, %s) == %d",
-				     expanded, v, bf);
+/*
+ * The superuser and ACL checks of one acl_check() together. With
+ * `mysql_nonblocking' the superquery and the aclquery run at the same
+ * time, on a connection each, so both cost a single round trip; either
+ * one failing is run again the usual way, with its retry on reconnect.
+ */
 
-				free(expanded);
-			}
+int be_mysql_superacl(void *handle, const char *clientid, const char *username, const char *topic, int acc, int *super, char **rule)
+{
+#ifdef MYSQL_NONBLOCKING
+	struct mysql_backend *conf = (struct mysql_backend *)handle;
+	struct mysql_arg sargs[1] = { { username, 0 } };
+	struct mysql_arg aargs[2] = { { username, 0 }, { NULL, acc } };
+	struct nbquery nb[2];
+	MYSQL_BIND sres, ares;
+	unsigned long slength, alength;
+	my_bool sis_null, ais_null;
+	int match;
+
+	if (conf && conf->nonblocking &&
+	    conf->queries[Q_SUPER].sql && conf->queries[Q_ACL].sql &&
+	    connected(conf, &conf->conns[0]) && connected(conf, &conf->conns[1]) &&
+	    result_bind(&sres, &slength, &sis_null) && result_bind(&ares, &alength, &ais_null)) {
+
+		nb_start(&nb[0], &conf->conns[0], &conf->queries[Q_SUPER], conf->conns[0].stmts[Q_SUPER], sargs, 1);
+		nb_start(&nb[1], &conf->conns[1], &conf->queries[Q_ACL], conf->conns[1].stmts[Q_ACL], aargs, 2);
+		nb_run(nb, 2);
+
+		if (nb[0].rc == 0 && mysql_stmt_field_count(nb[0].stmt) == 1 &&
+		    mysql_stmt_bind_result(nb[0].stmt, &sres) == 0) {
+			nb[0].c->last_used = time(NULL);
+			*super = super_rows(nb[0].stmt, &sres);
+		} else {
+			mysql_stmt_free_result(nb[0].stmt);
+			*super = be_mysql_superuser(handle, username);
+		}
+
+		if (nb[1].rc == 0 && mysql_stmt_field_count(nb[1].stmt) == 1 &&
+		    mysql_stmt_bind_result(nb[1].stmt, &ares) == 0) {
+			nb[1].c->last_used = time(NULL);
+			match = acl_rows(nb[1].stmt, &ares, clientid, username, topic, rule);
+		} else {
+			mysql_stmt_free_result(nb[1].stmt);
+			match = be_mysql_aclcheck_rule(handle, clientid, username, topic, acc, rule);
 		}
+		return (match);
 	}
+#endif
+	/* When the superuser check decides, the ACL result isn't used */
+	*super = be_mysql_superuser(handle, username);
+	if (*super == BACKEND_ALLOW || *super == BACKEND_DENY)
+		return BACKEND_DEFER;
+	return be_mysql_aclcheck_rule(handle, clientid, username, topic, acc, rule);
+}
 
-out:
+/*
+ * Whether be_mysql_superacl() can save a round trip, i.e. runs the two
+ * queries concurrently; otherwise the dispatcher is better off without it.
+ */
 
-	mysql_free_result(res);
-	free(query);
+bool be_mysql_nonblocking(void *handle)
+{
+	struct mysql_backend *conf = (struct mysql_backend *)handle;
 
-	return (match);
+	return conf && conf->nonblocking;
 }
 #endif  /* BE_MYSQL */
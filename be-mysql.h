@@ -29,11 +29,20 @@
 
 #ifdef BE_MYSQL
 
+#include <stdbool.h>
 #include <mysql.h>
 
+/* The MariaDB client library has a non-blocking API */
+#if defined(LIBMARIADB) || defined(MARIADB_BASE_VERSION)
+# define MYSQL_NONBLOCKING
+#endif
+
 void *be_mysql_init();
 void be_mysql_destroy(void *conf);
 int be_mysql_getuser(void *conf, const char *username, const char *password, char **phash, const char *clientid);
 int be_mysql_superuser(void *conf, const char *username);
 int be_mysql_aclcheck(void *conf, const char *clientid, const char *username, const char *topic, int acc);
+int be_mysql_aclcheck_rule(void *conf, const char *clientid, const char *username, const char *topic, int acc, char **rule);
+int be_mysql_superacl(void *conf, const char *clientid, const char *username, const char *topic, int acc, int *super, char **rule);
+bool be_mysql_nonblocking(void *conf);
 #endif /* BE_MYSQL */
@@ -33,15 +33,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <mosquitto.h>
 #include "be-postgres.h"
 #include "log.h"
 #include "hash.h"
 #include "backends.h"
+#include "arena.h"
+#include "cache.h"
 #include <arpa/inet.h>
 
-struct pg_backend {
+#define MAXREADHOSTS	(8)
+
+/*
+ * A connection to one server, and the state of its session.
+ */
+
+struct pg_conn {
 	PGconn *conn;
+	char *name;			/* host[:port], for the log */
+	char **values;			/* its connection parameters */
+	bool prepared;			/* the queries, on this session */
+	int superformat;		/* of the superquery's result */
+	bool broken;			/* the session is to be replaced */
+	bool resetting;			/* PQresetStart() done, polling */
+	PostgresPollingStatusType polling;
+	long attempt_start;		/* ms, of the reset in progress */
+	long next_attempt;
+	int backoff;			/* ms */
+	double latency;			/* ms, moving average */
+};
+
+/*
+ * A user named in a notification, whose lookups go to the primary for a
+ * while: a replica may not have caught up with the change yet. The
+ * listener queues them (NULL: everyone); the broker thread keeps them in
+ * a hash until they expire.
+ */
+
+struct pg_notice {
+	struct pg_notice *next;
+	char *username;
+	time_t expire;
+	UT_hash_handle hh;
+};
+
+#define READGRACE	(10)	/* s, default for pg_read_grace */
+
+struct pg_backend {
+	struct pg_conn conns[1 + MAXREADHOSTS];	/* the primary, then replicas */
+	int nconns;
+	unsigned int rotor;		/* where pg_pick() starts its scan */
 	char *host;
 	char *port;
 	char *dbname;
@@ -55,11 +103,607 @@ struct pg_backend {
 	   //MAY return n rows, 1 column, string
 	char *sslcert;
 	char *sslkey;
+	char *connect_timeout;		/* seconds, as libpq wants it */
+	int connect_budget;		/* s */
+	int statement_timeout;		/* milliseconds, 0 for none */
+	char **keywords;		/* connection parameters */
+	char *options;
+	char *channel;			/* to LISTEN on for invalidations */
+	pthread_t listener;
+	bool listening;
+	int stopfd[2];
+	_Atomic(char *) message;	/* from the listener, to log */
+	int read_grace;			/* s, primary only after a notification */
+	_Atomic(struct pg_notice *) notices;	/* from the listener */
+	struct pg_notice *recent;	/* users to read from the primary */
+	time_t everyone;		/* everyone, until then */
 };
 
 static int addKeyValue(char **keywords, char **values, char *key, char *value,
 		const int MAX_KEYS);
 
+static void post_message(struct pg_backend *conf, char *msg)
+{
+	free(atomic_exchange(&conf->message, msg));
+}
+
+/*
+ * Log what the listener thread had to say; only the broker thread may.
+ */
+
+static void messages(struct pg_backend *conf)
+{
+	char *msg;
+
+	if (atomic_load_explicit(&conf->message, memory_order_relaxed) != NULL &&
+	    (msg = atomic_exchange(&conf->message, NULL)) != NULL) {
+		_log(LOG_NOTICE, "%s", msg);
+		free(msg);
+	}
+}
+
+/*
+ * Queue a notice about `username' (NULL: everyone), from the listener.
+ */
+
+static void post_notice(struct pg_backend *conf, const char *username)
+{
+	struct pg_notice *n, *old;
+
+	if ((n = calloc(1, sizeof(struct pg_notice))) == NULL)
+		return;
+	if (username && (n->username = strdup(username)) == NULL) {
+		free(n);
+		return;
+	}
+	n->expire = time(NULL) + conf->read_grace;
+
+	old = atomic_load_explicit(&conf->notices, memory_order_relaxed);
+	do {
+		n->next = old;
+	} while (!atomic_compare_exchange_weak_explicit(&conf->notices, &old, n,
+			memory_order_release, memory_order_relaxed));
+}
+
+static void notice_free(struct pg_notice *n)
+{
+	free(n->username);
+	free(n);
+}
+
+/*
+ * Take over the listener's notices, and forget those which have expired.
+ */
+
+static void notices(struct pg_backend *conf)
+{
+	struct pg_notice *n, *next, *old, *tmp;
+	time_t now;
+
+	if (atomic_load_explicit(&conf->notices, memory_order_relaxed) == NULL)
+		return;
+
+	now = time(NULL);
+	n = atomic_exchange_explicit(&conf->notices, NULL, memory_order_acquire);
+	for (; n != NULL; n = next) {
+		next = n->next;
+		if (n->username == NULL) {
+			if (n->expire > conf->everyone)
+				conf->everyone = n->expire;
+			notice_free(n);
+			continue;
+		}
+		HASH_FIND_STR(conf->recent, n->username, old);
+		if (old != NULL) {
+			HASH_DEL(conf->recent, old);
+			notice_free(old);
+		}
+		HASH_ADD_KEYPTR(hh, conf->recent, n->username, strlen(n->username), n);
+	}
+	HASH_ITER(hh, conf->recent, n, tmp) {
+		if (n->expire <= now) {
+			HASH_DEL(conf->recent, n);
+			notice_free(n);
+		}
+	}
+}
+
+/*
+ * Whether `username' was named in a notification recently, so that
+ * replicas might still answer with what the notification revoked.
+ */
+
+static bool primary_only(struct pg_backend *conf, const char *username)
+{
+	struct pg_notice *n;
+	time_t now;
+
+	if (conf->nconns == 1 || !conf->listening)
+		return false;
+	notices(conf);
+	now = time(NULL);
+	if (now < conf->everyone)
+		return true;
+	HASH_FIND_STR(conf->recent, username, n);
+	return n != NULL && now < n->expire;
+}
+
+/*
+ * The queries are prepared under these names on every session, so the
+ * server parses and plans them once instead of on every lookup.
+ */
+
+enum { Q_USER, Q_SUPER, Q_ACL, NQUERIES };
+static const char *qnames[NQUERIES] = { "userquery", "superquery", "aclquery" };
+
+#ifndef BOOLOID
+# define BOOLOID	(16)
+# define INT8OID	(20)
+# define INT2OID	(21)
+# define INT4OID	(23)
+#endif
+
+#define MINBACKOFF	(250)		/* ms before trying to reconnect again */
+#define MAXBACKOFF	(30000)
+#define CONNECTBUDGET	(10)		/* seconds for connecting, by default */
+
+static long now_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Give up on the session: pg_healthy() will start over on a new one,
+ * which has to prepare the queries again.
+ */
+
+static void pg_reset(struct pg_conn *c, const char *why)
+{
+	if (!c->broken) {
+		_log(LOG_NOTICE, "postgres: %s: %s; reconnecting", c->name, why);
+		c->broken = true;
+		c->prepared = false;
+	}
+}
+
+/*
+ * Wait a while before the next attempt to reconnect: exponentially
+ * longer after each failure, but only roughly, so brokers which lost the
+ * server together don't hammer it together when it comes back.
+ */
+
+static void backoff(struct pg_conn *c)
+{
+	c->backoff = (c->backoff == 0) ? MINBACKOFF :
+		(c->backoff * 2 > MAXBACKOFF) ? MAXBACKOFF : c->backoff * 2;
+	c->next_attempt = now_ms() + c->backoff / 2 + random() % (c->backoff / 2 + 1);
+	c->resetting = false;
+}
+
+/*
+ * Whether the connection can be used. A broken one is re-established with
+ * PQresetStart() and PQresetPoll(), a step whenever a lookup comes along
+ * and the socket is ready, so lookups never wait for the server to come
+ * back: until it has, they fail right away.
+ */
+
+static bool pg_healthy(struct pg_backend *conf, struct pg_conn *c)
+{
+	PostgresPollingStatusType st;
+	struct pollfd pfd;
+
+	if (!c->resetting) {
+		if (!c->broken && PQstatus(c->conn) == CONNECTION_OK)
+			return true;
+		c->broken = true;
+		c->prepared = false;
+		if (now_ms() < c->next_attempt)
+			return false;
+		if (!PQresetStart(c->conn)) {
+			_log(LOG_NOTICE, "postgres: %s: can't reconnect: %s", c->name, PQerrorMessage(c->conn));
+			backoff(c);
+			return false;
+		}
+		c->resetting = true;
+		c->attempt_start = now_ms();
+		c->polling = PGRES_POLLING_WRITING;
+	}
+
+	pfd.fd = PQsocket(c->conn);
+	pfd.events = (c->polling == PGRES_POLLING_READING) ? POLLIN : POLLOUT;
+	if (poll(&pfd, 1, 0) == 1) {
+		switch (st = PQresetPoll(c->conn)) {
+		case PGRES_POLLING_OK:
+			_log(LOG_NOTICE, "postgres: %s: reconnected", c->name);
+			c->resetting = false;
+			c->broken = false;
+			c->backoff = 0;
+			return true;
+		case PGRES_POLLING_FAILED:
+			_log(LOG_NOTICE, "postgres: %s: can't reconnect: %s", c->name, PQerrorMessage(c->conn));
+			backoff(c);
+			return false;
+		default:
+			c->polling = st;
+		}
+	}
+	if (now_ms() - c->attempt_start > conf->connect_budget * 1000L) {
+		_log(LOG_NOTICE, "postgres: %s: can't reconnect within %d s", c->name, conf->connect_budget);
+		backoff(c);
+	}
+	return false;
+}
+
+/*
+ * Wait until the connection is done with a query we gave up on, so a new
+ * one can be sent. If the answer still hasn't come, the server or the
+ * network to it is hung: start over on a new connection.
+ */
+
+static void pg_idle(struct pg_conn *c)
+{
+	PGresult *res;
+
+	if (PQtransactionStatus(c->conn) != PQTRANS_ACTIVE)
+		return;
+	if (PQconsumeInput(c->conn)) {
+		while (!PQisBusy(c->conn)) {
+			if ((res = PQgetResult(c->conn)) == NULL)
+				return;
+			PQclear(res);
+		}
+	}
+	pg_reset(c, "previous query still unanswered");
+}
+
+static long elapsed_ms(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static bool out_of_time(struct pg_backend *conf, struct timespec *start)
+{
+	return conf->statement_timeout > 0 && elapsed_ms(start) >= conf->statement_timeout;
+}
+
+/*
+ * Collect the result of the command just sent (`sent' is what the
+ * PQsend* function returned). With `pg_statement_timeout' the server
+ * cancels a query after that long, and we stop waiting for it after as
+ * long since the call began at `start': a hung server or a half-open
+ * connection would otherwise hold up the broker until the kernel gives
+ * up. Returns NULL, like a failed query, when the time is up.
+ */
+
+static PGresult *pg_wait(struct pg_backend *conf, struct pg_conn *c, int sent, struct timespec *start)
+{
+	PGresult *res, *last = NULL;
+	struct pollfd pfd;
+	long left = -1;
+
+	if (!sent)
+		return NULL;
+
+	for (;;) {
+		while (!PQisBusy(c->conn)) {
+			if ((res = PQgetResult(c->conn)) == NULL)
+				return last;
+			PQclear(last);
+			last = res;
+		}
+		if (conf->statement_timeout > 0 &&
+		    (left = conf->statement_timeout - elapsed_ms(start)) <= 0) {
+			_log(LOG_NOTICE, "postgres: %s: no answer within %d ms", c->name, conf->statement_timeout);
+			break;
+		}
+		pfd.fd = PQsocket(c->conn);
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, left) < 0 && errno != EINTR)
+			break;
+		if (!PQconsumeInput(c->conn))
+			break;
+	}
+	PQclear(last);
+	return NULL;
+}
+
+static bool binary_type(Oid type)
+{
+	return type == BOOLOID || type == INT2OID || type == INT4OID || type == INT8OID;
+}
+
+/*
+ * Prepare the queries on the current session. The superquery's flag is
+ * asked for in binary when it's a boolean or an integer, which saves
+ * formatting and parsing a number.
+ */
+
+static bool pg_prepare(struct pg_backend *conf, struct pg_conn *c, struct timespec *start)
+{
+	const char *queries[NQUERIES] = { conf->userquery, conf->superquery, conf->aclquery };
+	PGresult *res;
+	int i;
+
+	for (i = 0; i < NQUERIES; i++) {
+		if (queries[i] == NULL)
+			continue;
+		res = pg_wait(conf, c, PQsendPrepare(c->conn, qnames[i], queries[i], 0, NULL), start);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			_log(LOG_NOTICE, "postgres: %s: can't prepare %s: %s", c->name, queries[i], PQresultErrorMessage(res));
+			PQclear(res);
+			return false;
+		}
+		PQclear(res);
+	}
+
+	c->superformat = 0;
+	if (conf->superquery) {
+		res = pg_wait(conf, c, PQsendDescribePrepared(c->conn, qnames[Q_SUPER]), start);
+		if (PQresultStatus(res) == PGRES_COMMAND_OK && PQnfields(res) == 1 &&
+		    binary_type(PQftype(res, 0)))
+			c->superformat = 1;
+		PQclear(res);
+	}
+	c->prepared = true;
+	return true;
+}
+
+/*
+ * Pick the connection for the next lookup, out of those not `tried' yet.
+ * With `pg_read_hosts' that's a replica, unless none can be used right
+ * now; the primary is the last resort. The broker makes one lookup at a
+ * time, so no server has more outstanding work than another: the one
+ * which has been answering fastest is chosen. The others' averages decay
+ * meanwhile, so a server which was slow once gets another chance later.
+ * With `primary', only the primary will do.
+ */
+
+static struct pg_conn *pg_pick(struct pg_backend *conf, unsigned int tried, bool primary)
+{
+	struct pg_conn *c, *best = NULL;
+	int i, n, nreplicas = (primary) ? 0 : conf->nconns - 1;
+
+	/* Start the scan at a different host each time, so ties are spread */
+	conf->rotor++;
+	for (n = 0; n < nreplicas; n++) {
+		i = 1 + (conf->rotor + n) % nreplicas;
+		c = &conf->conns[i];
+		if (tried & (1U << i))
+			continue;
+		pg_idle(c);
+		if (!pg_healthy(conf, c))
+			continue;
+		if (best == NULL || c->latency < best->latency)
+			best = c;
+	}
+	if (best != NULL) {
+		for (i = 1; i < conf->nconns; i++) {
+			if (&conf->conns[i] != best)
+				conf->conns[i].latency *= 0.99;
+		}
+		return best;
+	}
+
+	c = &conf->conns[0];
+	if (!(tried & 1U)) {
+		pg_idle(c);
+		if (pg_healthy(conf, c))
+			return c;
+	}
+	return NULL;
+}
+
+static void pg_measured(struct pg_conn *c, struct timespec *start)
+{
+	struct timespec now;
+	double ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+	c->latency = (c->latency == 0) ? ms : 0.8 * c->latency + 0.2 * ms;
+}
+
+/*
+ * Execute the prepared query `q' with the text parameters `values'. If
+ * the connection fails, the query is tried on the next server, as long
+ * as there is time left.
+ */
+
+static PGresult *pg_exec(struct pg_backend *conf, int q, int nparams, const char * const *values)
+{
+	struct timespec start;
+	struct pg_conn *c;
+	unsigned int tried = 0;
+	PGresult *res;
+	bool primary;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	messages(conf);
+	primary = primary_only(conf, values[0]);	/* the username */
+
+	while ((c = pg_pick(conf, tried, primary)) != NULL) {
+		tried |= 1U << (c - conf->conns);
+		res = NULL;
+		if (c->prepared || pg_prepare(conf, c, &start)) {
+			res = pg_wait(conf, c, PQsendQueryPrepared(c->conn, qnames[q], nparams, values, NULL, NULL,
+				(q == Q_SUPER) ? c->superformat : 0), &start);
+		}
+		if (PQstatus(c->conn) != CONNECTION_BAD) {
+			if (res != NULL)
+				pg_measured(c, &start);
+			return res;
+		}
+		PQclear(res);
+		pg_reset(c, "noticed a connection loss");
+		if (out_of_time(conf, &start))
+			break;
+	}
+	return NULL;
+}
+
+#define MAXLISTENBACKOFF	(60)	/* seconds between attempts to LISTEN */
+
+static PGconn *listen_connect(struct pg_backend *conf)
+{
+	const char *keywords[16], *values[16];
+	char err[512], *ident, *sql;
+	PGconn *conn;
+	PGresult *res;
+	int n;
+
+	/* A connection which only waits has to probe the server to notice it's gone */
+	for (n = 0; conf->keywords[n] && n < 12; n++) {
+		keywords[n] = conf->keywords[n];
+		values[n] = conf->conns[0].values[n];
+	}
+	keywords[n] = "keepalives_idle";	values[n++] = "30";
+	keywords[n] = "keepalives_interval";	values[n++] = "10";
+	keywords[n] = "keepalives_count";	values[n++] = "3";
+	keywords[n] = NULL;			values[n] = NULL;
+
+	conn = PQconnectdbParams(keywords, values, 0);
+	if (PQstatus(conn) != CONNECTION_OK) {
+		snprintf(err, sizeof(err), "postgres: can't connect to LISTEN: %s", PQerrorMessage(conn));
+		post_message(conf, strdup(err));
+		PQfinish(conn);
+		return NULL;
+	}
+
+	sql = NULL;
+	if ((ident = PQescapeIdentifier(conn, conf->channel, strlen(conf->channel))) != NULL &&
+	    (sql = malloc(strlen(ident) + 8)) != NULL) {
+		sprintf(sql, "LISTEN %s", ident);
+		res = PQexec(conn, sql);
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			snprintf(err, sizeof(err), "postgres: can't LISTEN %s: %s", ident, PQresultErrorMessage(res));
+			post_message(conf, strdup(err));
+			PQfinish(conn);
+			conn = NULL;
+		}
+		PQclear(res);
+	}
+	if (sql == NULL) {
+		PQfinish(conn);
+		conn = NULL;
+	}
+	free(sql);
+	PQfreemem(ident);
+	return conn;
+}
+
+#define MAXNOTIFYBATCH	(1000)	/* users named at once; more invalidate everything */
+
+struct notified {
+	char *username;
+	UT_hash_handle hh;
+};
+
+/*
+ * Pass the notifications which have arrived to the caches as one batch,
+ * so that a burst of them (e.g. a trigger per row of a bulk UPDATE)
+ * names each user once, or has everything dropped once.
+ */
+
+static void pg_notified(struct pg_backend *conf, PGconn *conn)
+{
+	struct notified *set = NULL, *u, *tmp;
+	PGnotify *n;
+	bool all = false;
+
+	while ((n = PQnotifies(conn)) != NULL) {
+		if (n->extra == NULL || *n->extra == 0 || HASH_COUNT(set) >= MAXNOTIFYBATCH) {
+			all = true;
+		} else if (!all) {
+			HASH_FIND_STR(set, n->extra, u);
+			if (u == NULL) {
+				if ((u = malloc(sizeof(struct notified))) == NULL ||
+				    (u->username = strdup(n->extra)) == NULL) {
+					free(u);
+					all = true;
+				} else {
+					HASH_ADD_KEYPTR(hh, set, u->username, strlen(u->username), u);
+				}
+			}
+		}
+		PQfreemem(n);
+	}
+
+	/* Replicas are avoided before anything is missed in the caches */
+	HASH_ITER(hh, set, u, tmp) {
+		if (!all) {
+			post_notice(conf, u->username);
+			cache_invalidate(u->username);
+		}
+		HASH_DEL(set, u);
+		free(u->username);
+		free(u);
+	}
+	if (all) {
+		post_notice(conf, NULL);
+		cache_invalidate(NULL);
+	}
+}
+
+/*
+ * Listener thread: keep a connection of its own LISTENing on
+ * `pg_listen_channel', and have the caches forget about the user named
+ * in each notification (about everyone, for an empty payload).
+ * Notifications sent while it wasn't listening are lost, so whenever it
+ * starts listening it has all cached answers dropped.
+ */
+
+static void *pg_listen(void *arg)
+{
+	struct pg_backend *conf = (struct pg_backend *)arg;
+	PGconn *conn = NULL;
+	struct pollfd pfd[2];
+	int delay = 1;
+
+	pfd[0].fd = conf->stopfd[0];
+	pfd[0].events = POLLIN;
+
+	for (;;) {
+		pfd[0].revents = 0;
+		if (conn == NULL) {
+			if ((conn = listen_connect(conf)) == NULL) {
+				if (poll(pfd, 1, delay * 1000) > 0)
+					break;
+				delay = (delay * 2 > MAXLISTENBACKOFF) ? MAXLISTENBACKOFF : delay * 2;
+				continue;
+			}
+			delay = 1;
+			post_notice(conf, NULL);
+			cache_invalidate(NULL);
+		}
+
+		pfd[1].fd = PQsocket(conn);
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		if (poll(pfd, 2, -1) < 0)
+			continue;
+		if (pfd[0].revents)
+			break;
+		if (!PQconsumeInput(conn)) {
+			char err[512];
+
+			snprintf(err, sizeof(err), "postgres: lost the connection to LISTEN: %s", PQerrorMessage(conn));
+			post_message(conf, strdup(err));
+			PQfinish(conn);
+			conn = NULL;
+			continue;
+		}
+		pg_notified(conf, conn);
+	}
+	PQfinish(conn);
+	return NULL;
+}
+
 void *be_pg_init()
 {
 	struct pg_backend *conf;
@@ -67,6 +711,9 @@ void *be_pg_init()
 	char *userquery;
 	char **keywords = NULL;
 	char **values = NULL;
+	char options[64];
+	struct timespec start;
+	int i;
 
 	_log(LOG_DEBUG, "}}}} POSTGRES");
 
@@ -87,10 +734,9 @@ void *be_pg_init()
 		_fatal("Mandatory option 'userquery' is missing");
 		return (NULL);
 	}
-	if ((conf = (struct pg_backend *)malloc(sizeof(struct pg_backend))) == NULL)
+	if ((conf = (struct pg_backend *)calloc(1, sizeof(struct pg_backend))) == NULL)
 		return (NULL);
 
-	conf->conn = NULL;
 	conf->host = host;
 	conf->port = port;
 	conf->user = user;
@@ -101,11 +747,18 @@ void *be_pg_init()
 	conf->aclquery = p_stab("aclquery");
 	conf->sslcert = sslcert;
 	conf->sslkey = sslkey;
+	conf->connect_timeout = p_stab("pg_connect_timeout");
+	conf->connect_budget = (conf->connect_timeout && atoi(conf->connect_timeout) > 0) ?
+		atoi(conf->connect_timeout) : CONNECTBUDGET;
+	conf->statement_timeout = (p = p_stab("pg_statement_timeout")) ? atoi(p) : 0;
+	conf->channel = p_stab("pg_listen_channel");
+	conf->read_grace = (p = p_stab("pg_read_grace")) ? atoi(p) : READGRACE;
+	atomic_init(&conf->message, NULL);
 
 	_log(LOG_DEBUG, "HERE: %s", conf->superquery);
 	_log(LOG_DEBUG, "HERE: %s", conf->aclquery);
 
-	const uint8_t MAX_KEYS = 7;
+	const uint8_t MAX_KEYS = 9;
 	keywords = (char **) calloc(MAX_KEYS + 1, sizeof(char *));
 	values = (char **) calloc(MAX_KEYS + 1, sizeof(char *));
 
@@ -130,17 +783,77 @@ void *be_pg_init()
 	if (conf->sslkey) {
 		addKeyValue(keywords, values, "sslkey", conf->sslkey, MAX_KEYS);
 	}
+	if (conf->connect_timeout) {
+		addKeyValue(keywords, values, "connect_timeout", conf->connect_timeout, MAX_KEYS);
+	}
+	if (conf->statement_timeout > 0) {
+		/* Have the server cancel queries which run too long */
+		snprintf(options, sizeof(options), "-c statement_timeout=%d", conf->statement_timeout);
+		conf->options = strdup(options);
+		addKeyValue(keywords, values, "options", conf->options, MAX_KEYS);
+	}
+	conf->keywords = keywords;
+	conf->conns[0].name = strdup("primary");
+	conf->conns[0].values = values;
+	conf->nconns = 1;
 
-	conf->conn = PQconnectdbParams(
-		(const char * const *)keywords, (const char * const *)values, 0);
+	/* Replicas: the same parameters but for host and port */
+	if ((p = p_stab("pg_read_hosts")) != NULL) {
+		char *list = strdup(p), *tok, *save, *colon;
 
-	free(keywords);
-	free(values);
+		for (tok = strtok_r(list, ", ", &save); tok; tok = strtok_r(NULL, ", ", &save)) {
+			struct pg_conn *c = &conf->conns[conf->nconns];
 
-	if (PQstatus(conf->conn) == CONNECTION_BAD) {
-		free(conf);
-		_fatal("We were unable to connect to the database");
-		return (NULL);
+			if (conf->nconns > MAXREADHOSTS) {
+				_log(LOG_NOTICE, "postgres: only %d pg_read_hosts are used", MAXREADHOSTS);
+				break;
+			}
+			c->name = strdup(tok);
+			c->values = (char **) calloc(MAX_KEYS + 1, sizeof(char *));
+			memcpy(c->values, values, (MAX_KEYS + 1) * sizeof(char *));
+			if ((colon = strrchr(tok, ':')) != NULL)
+				*colon++ = 0;
+			for (i = 0; keywords[i]; i++) {
+				if (!strcmp(keywords[i], "host"))
+					c->values[i] = strdup(tok);
+				if (!strcmp(keywords[i], "port"))
+					c->values[i] = strdup(colon ? colon : conf->port);
+			}
+			conf->nconns++;
+		}
+		free(list);
+	}
+
+	for (i = 0; i < conf->nconns; i++) {
+		struct pg_conn *c = &conf->conns[i];
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		c->conn = PQconnectdbParams(
+			(const char * const *)keywords, (const char * const *)c->values, 0);
+
+		if (PQstatus(c->conn) == CONNECTION_BAD) {
+			/* Lookups fail until the server is back, instead of the broker */
+			_log(LOG_NOTICE, "postgres: %s: can't connect: %s", c->name, PQerrorMessage(c->conn));
+			c->broken = true;
+		} else if (!pg_prepare(conf, c, &start)) {
+			_fatal("We were unable to prepare the queries");
+			return (NULL);
+		}
+	}
+
+	if (conf->channel) {
+		if (pipe(conf->stopfd) != 0) {
+			_fatal("postgres: pipe: %s", strerror(errno));
+			return (NULL);
+		}
+		fcntl(conf->stopfd[0], F_SETFD, FD_CLOEXEC);
+		fcntl(conf->stopfd[1], F_SETFD, FD_CLOEXEC);
+		if (pthread_create(&conf->listener, NULL, pg_listen, conf) != 0) {
+			_fatal("postgres: can't start the listener thread");
+			return (NULL);
+		}
+		conf->listening = true;
+		_log(LOG_DEBUG, "postgres: listening on %s for invalidations", conf->channel);
 	}
 
 	return ((void *)conf);
@@ -149,9 +862,38 @@ void *be_pg_init()
 void be_pg_destroy(void *handle)
 {
 	struct pg_backend *conf = (struct pg_backend *)handle;
+	struct pg_notice *n, *next;
+	int i, k;
 
 	if (conf) {
-		PQfinish(conf->conn);
+		if (conf->listening) {
+			if (write(conf->stopfd[1], "", 1) == 1)
+				pthread_join(conf->listener, NULL);
+			close(conf->stopfd[0]);
+			close(conf->stopfd[1]);
+		}
+		free(atomic_load(&conf->message));
+		for (n = atomic_load(&conf->notices); n != NULL; n = next) {
+			next = n->next;
+			notice_free(n);
+		}
+		HASH_ITER(hh, conf->recent, n, next) {
+			HASH_DEL(conf->recent, n);
+			notice_free(n);
+		}
+		for (i = 0; i < conf->nconns; i++) {
+			PQfinish(conf->conns[i].conn);
+			free(conf->conns[i].name);
+			if (i > 0) {
+				for (k = 0; conf->keywords[k]; k++) {
+					if (!strcmp(conf->keywords[k], "host") || !strcmp(conf->keywords[k], "port"))
+						free(conf->conns[i].values[k]);
+				}
+			}
+			free(conf->conns[i].values);
+		}
+		free(conf->keywords);
+		free(conf->options);
 		if (conf->userquery)
 			free(conf->userquery);
 		if (conf->superquery)
@@ -167,6 +909,7 @@ int be_pg_getuser(void *handle, const char *username, const char *password, char
 	struct pg_backend *conf = (struct pg_backend *)handle;
 	char *value = NULL, *v = NULL;
 	long nrows;
+	int rc = BACKEND_DEFER;
 	PGresult *res = NULL;
 
 	_log(LOG_DEBUG, "GETTING USERS: %s", username);
@@ -175,19 +918,12 @@ int be_pg_getuser(void *handle, const char *username, const char *password, char
 		return BACKEND_DEFER;
 
 	const char *values[1] = {username};
-	int lengths[1] = {strlen(username)};
-	int binary[1] = {0};
 
-	res = PQexecParams(conf->conn, conf->userquery, 1, NULL, values, lengths, binary, 0);
+	res = pg_exec(conf, Q_USER, 1, values);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		_log(LOG_DEBUG, "%s\n", PQresultErrorMessage(res));
-		if(PQstatus(conf->conn) == CONNECTION_BAD){
-			_log(LOG_NOTICE, "Noticed a postgres connection loss. Trying to reconnect ...\n");
-			//try to reinitiate the database connection
-			PQreset(conf->conn);
-		}
-		
+		rc = BACKEND_ERROR;
 		goto out;
 	}
 	if ((nrows = PQntuples(res)) != 1) {
@@ -209,43 +945,22 @@ out:
 	PQclear(res);
 
 	*phash = value;
-	return BACKEND_DEFER;
+	return rc;
 }
 
 /*
- * Return T/F if user is superuser
+ * Superuser flag from the superquery's result, which is cleared.
  */
 
-int be_pg_superuser(void *handle, const char *username)
+static int super_result(struct pg_backend *conf, PGresult *res)
 {
-	struct pg_backend *conf = (struct pg_backend *)handle;
 	char *v = NULL;
 	long nrows;
 	int issuper = BACKEND_DEFER;
-	PGresult *res = NULL;
-
-	_log(LOG_DEBUG, "SUPERUSER: %s", username);
-
-	if (!conf || !conf->superquery || !username || !*username)
-		return BACKEND_DEFER;
-
-	//query for postgres $1 instead of % s
-	const char *values[1] = {username};
-	int lengths[1] = {strlen(username)};
-	int binary[1] = {0};
-
-	res = PQexecParams(conf->conn, conf->superquery, 1, NULL, values, lengths, binary, 0);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		fprintf(stderr, "%s\n", PQresultErrorMessage(res));
 		issuper = BACKEND_ERROR;
-		//try to reset connection if failing because of database connection lost
-		if(PQstatus(conf->conn) == CONNECTION_BAD){
-			_log(LOG_NOTICE, "Noticed a postgres connection loss. Trying to reconnect ...\n");
-			//try to reinitiate the database connection
-			PQreset(conf->conn);
-		}
-
 		goto out;
 	}
 	if ((nrows = PQntuples(res)) != 1) {
@@ -258,7 +973,16 @@ int be_pg_superuser(void *handle, const char *username)
 	if ((v = PQgetvalue(res, 0, 0)) == NULL) {
 		goto out;
 	}
-	issuper = (atoi(v)) ? BACKEND_ALLOW : BACKEND_DEFER;
+	if (PQfformat(res, 0) == 1) {
+		/* A binary boolean or integer (big-endian) is non-zero iff a byte is */
+		int len = PQgetlength(res, 0, 0);
+
+		while (len > 0 && v[len - 1] == 0)
+			len--;
+		issuper = (len > 0) ? BACKEND_ALLOW : BACKEND_DEFER;
+	} else {
+		issuper = (atoi(v)) ? BACKEND_ALLOW : BACKEND_DEFER;
+	}
 
 
 out:
@@ -270,53 +994,38 @@ out:
 }
 
 /*
- * Check ACL. username is the name of the connected user attempting to access
- * topic is the topic user is trying to access (may contain wildcards) acc is
- * desired type of access: read/write for subscriptions (READ) (1) for
- * publish (WRITE) (2)
- *
- * SELECT topic FROM table WHERE username = '%s' AND (acc & %d)
- * may user SUB or PUB topic?
- *
- * SELECT topic FROM table WHERE username = '%s'
- * ignore ACC
+ * Return T/F if user is superuser
  */
 
-int be_pg_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
+int be_pg_superuser(void *handle, const char *username)
 {
 	struct pg_backend *conf = (struct pg_backend *)handle;
-	char *v = NULL;
-	int match = BACKEND_DEFER;
-	bool bf;
-	PGresult *res = NULL;
-
-	_log(LOG_DEBUG, "USERNAME: %s, TOPIC: %s, acc: %d", username, topic, acc);
 
+	_log(LOG_DEBUG, "SUPERUSER: %s", username);
 
-	if (!conf || !conf->aclquery)
+	if (!conf || !conf->superquery || !username || !*username)
 		return BACKEND_DEFER;
 
-	const int buflen = 11;
-	//10 for 2^32 + 1
-	char accbuffer[buflen];
-	snprintf(accbuffer, buflen, "%d", acc);
+	//query for postgres $1 instead of % s
+	const char *values[1] = {username};
 
-	const char *values[2] = {username, accbuffer};
-	int lengths[2] = {strlen(username), buflen};
+	return super_result(conf, pg_exec(conf, Q_SUPER, 1, values));
+}
 
-	res = PQexecParams(conf->conn, conf->aclquery, 2, NULL, values, lengths, NULL, 0);
+/*
+ * Match `topic' against the topic filters in the aclquery's result,
+ * which is cleared.
+ */
+
+static int acl_result(struct pg_backend *conf, PGresult *res, const char *clientid, const char *username, const char *topic, char **rule)
+{
+	char *v = NULL;
+	int match = BACKEND_DEFER;
+	bool bf;
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
 		fprintf(stderr, "%s\n", PQresultErrorMessage(res));
 		match = BACKEND_ERROR;
-
-		//try to reset connection if failing because of database connection lost
-		if(PQstatus(conf->conn) == CONNECTION_BAD){
-			_log(LOG_NOTICE, "Noticed a postgres connection loss. Trying to reconnect ...\n");
-			//try to reinitiate the database connection
-			PQreset(conf->conn);
-		}
-
 		goto out;
 	}
 	if (PQnfields(res) != 1) {
@@ -335,14 +1044,15 @@ int be_pg_aclcheck(void *handle, const char *clientid, const char *username, con
 
 			char *expanded;
 
-			t_expand(clientid, username, v, &expanded);
+			expanded = t_expand_arena(be_arena, clientid, username, v);
 			if (expanded && *expanded) {
-				mosquitto_topic_matches_sub(expanded, topic, &bf);
+				t_matches(expanded, topic, &bf);
 				if (bf) match = BACKEND_ALLOW;
 				_log(LOG_DEBUG, "  postgres: topic_matches(%s, %s) == %d",
 				     expanded, v, bf);
 
-				free(expanded);
+				if (bf && rule)
+					*rule = strdup(expanded);
 			}
 		}
 		if (match != BACKEND_DEFER) {
@@ -357,6 +1067,113 @@ out:
 	return (match);
 }
 
+/*
+ * Check ACL. username is the name of the connected user attempting to access
+ * topic is the topic user is trying to access (may contain wildcards) acc is
+ * desired type of access: read/write for subscriptions (READ) (1) for
+ * publish (WRITE) (2)
+ *
+ * SELECT topic FROM table WHERE username = '%s' AND (acc & %d)
+ * may user SUB or PUB topic?
+ *
+ * SELECT topic FROM table WHERE username = '%s'
+ * ignore ACC
+ *
+ * If `rule' is not NULL it receives the expanded topic filter which matched.
+ */
+
+int be_pg_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
+{
+	return be_pg_aclcheck_rule(handle, clientid, username, topic, acc, NULL);
+}
+
+int be_pg_aclcheck_rule(void *handle, const char *clientid, const char *username, const char *topic, int acc, char **rule)
+{
+	struct pg_backend *conf = (struct pg_backend *)handle;
+
+	_log(LOG_DEBUG, "USERNAME: %s, TOPIC: %s, acc: %d", username, topic, acc);
+
+
+	if (!conf || !conf->aclquery)
+		return BACKEND_DEFER;
+
+	const int buflen = 11;
+	//10 for 2^32 + 1
+	char accbuffer[buflen];
+	snprintf(accbuffer, buflen, "%d", acc);
+
+	const char *values[2] = {username, accbuffer};
+
+	return acl_result(conf, pg_exec(conf, Q_ACL, 2, values), clientid, username, topic, rule);
+}
+
+/*
+ * The superuser and ACL checks of one acl_check() together. With libpq's
+ * pipeline mode both queries go out back-to-back and their results come
+ * back in a single round trip.
+ */
+
+int be_pg_superacl(void *handle, const char *clientid, const char *username, const char *topic, int acc, int *super, char **rule)
+{
+#ifdef LIBPQ_HAS_PIPELINING
+	struct pg_backend *conf = (struct pg_backend *)handle;
+	PGresult *sres, *ares, *sync;
+	struct pg_conn *c;
+	struct timespec start;
+	char accbuffer[11];
+	int sent;
+
+	if (!conf || !conf->superquery || !conf->aclquery || !username || !*username)
+		goto serial;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	messages(conf);
+	if ((c = pg_pick(conf, 0, primary_only(conf, username))) == NULL) {
+		*super = BACKEND_ERROR;
+		return BACKEND_ERROR;
+	}
+	if (!c->prepared && !pg_prepare(conf, c, &start))
+		goto serial;
+	if (!PQenterPipelineMode(c->conn))
+		goto serial;
+
+	_log(LOG_DEBUG, "SUPERACL: %s, TOPIC: %s, acc: %d (%s)", username, topic, acc, c->name);
+
+	snprintf(accbuffer, sizeof(accbuffer), "%d", acc);
+	const char *svalues[1] = {username};
+	const char *avalues[2] = {username, accbuffer};
+
+	sent = PQsendQueryPrepared(c->conn, qnames[Q_SUPER], 1, svalues, NULL, NULL, c->superformat) &&
+	       PQsendQueryPrepared(c->conn, qnames[Q_ACL], 2, avalues, NULL, NULL, 0) &&
+	       PQpipelineSync(c->conn);
+
+	/* Each query's result, then the sync's */
+	sres = pg_wait(conf, c, sent, &start);
+	ares = (sres) ? pg_wait(conf, c, 1, &start) : NULL;
+	sync = (ares) ? pg_wait(conf, c, 1, &start) : NULL;
+
+	if (PQresultStatus(sync) != PGRES_PIPELINE_SYNC || !PQexitPipelineMode(c->conn)) {
+		/* Results still in flight: no telling where in the pipeline we are */
+		pg_reset(c, "pipeline incomplete");
+	} else {
+		pg_measured(c, &start);
+	}
+	PQclear(sync);
+
+	if (c->broken && !sres && !out_of_time(conf, &start)) {
+		/* The host went away: the serial path tries the next one */
+		goto serial;
+	}
+
+	*super = super_result(conf, sres);
+	return acl_result(conf, ares, clientid, username, topic, rule);
+
+    serial:
+#endif
+	*super = be_pg_superuser(handle, username);
+	return be_pg_aclcheck_rule(handle, clientid, username, topic, acc, rule);
+}
+
 /*
  * addKeyValue - Adds key-value pair to index-linked 'dictionary'.
  *
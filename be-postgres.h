@@ -36,4 +36,6 @@ void be_pg_destroy(void *conf);
 int be_pg_getuser(void *conf, const char *username, const char *password, char **phash, const char *clientid);
 int be_pg_superuser(void *conf, const char *username);
 int be_pg_aclcheck(void *conf, const char *clientid, const char *username, const char *topic, int acc);
+int be_pg_aclcheck_rule(void *conf, const char *clientid, const char *username, const char *topic, int acc, char **rule);
+int be_pg_superacl(void *conf, const char *clientid, const char *username, const char *topic, int acc, int *super, char **rule);
 #endif /* BE_POSTGRES */
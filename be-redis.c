@@ -32,24 +32,202 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include "log.h"
 #include "hash.h"
+#include "arena.h"
 #include "backends.h"
 #include <hiredis/hiredis.h>
 
+#define MAXCMDS		(8)	/* commands in one query */
+#define MAXARGS		(16)	/* arguments of one command */
+
+/*
+ * A configured query, split once into its commands and their arguments.
+ * Arguments with a `%s' are expanded for each lookup and sent as they
+ * are, so usernames and topics with spaces or `%' can't change the
+ * command; the others are sent unchanged.
+ */
+
+struct redis_cmd {
+	int argc;
+	char *argv[MAXARGS];
+	size_t argvlen[MAXARGS];
+	bool expand[MAXARGS];
+};
+
+struct redis_query {
+	int ncmds;
+	struct redis_cmd cmds[MAXCMDS];
+};
+
 struct redis_backend {
 	redisContext *redis;
 	char *host;
 	char *userquery;
 	char *aclquery;
+	struct redis_query user;
+	struct redis_query acl;
 	char *dbpass;
 	int port;
 	int db;
 };
 
+/*
+ * Split `query' into `;'-separated commands of whitespace-separated
+ * arguments.
+ */
+
+static bool query_parse(struct redis_query *q, const char *query)
+{
+	char *copy = strdup(query), *cmd, *arg, *save1, *save2;
+	struct redis_cmd *c;
+	bool ok = true;
+
+	q->ncmds = 0;
+	for (cmd = strtok_r(copy, ";", &save1); ok && cmd; cmd = strtok_r(NULL, ";", &save1)) {
+		if ((arg = strtok_r(cmd, " \t", &save2)) == NULL)
+			continue;
+		if (q->ncmds == MAXCMDS) {
+			ok = false;
+			break;
+		}
+		c = &q->cmds[q->ncmds++];
+		c->argc = 0;
+		for (; arg; arg = strtok_r(NULL, " \t", &save2)) {
+			if (c->argc == MAXARGS) {
+				ok = false;
+				break;
+			}
+			c->argv[c->argc] = strdup(arg);
+			c->argvlen[c->argc] = strlen(arg);
+			c->expand[c->argc] = (strchr(arg, '%') != NULL);
+			c->argc++;
+		}
+	}
+	free(copy);
+	return ok && q->ncmds > 0;
+}
+
+static void query_free(struct redis_query *q)
+{
+	int n, i;
+
+	for (n = 0; n < q->ncmds; n++) {
+		for (i = 0; i < q->cmds[n].argc; i++)
+			free(q->cmds[n].argv[i]);
+	}
+	q->ncmds = 0;
+}
+
+/*
+ * Expand the argument `arg' into the call's arena: each `%s' is replaced
+ * by the next of the `nparams' parameters (or by nothing when they have
+ * run out), and `%%' by `%'. `*next' is the index of the next parameter;
+ * it carries over from one argument of a command to the next.
+ */
+
+static char *arg_expand(const char *arg, const char **params, int nparams,
+		int *next, size_t *len)
+{
+	const char *s;
+	char *buf, *d;
+	size_t n = 0;
+	int p = *next;
+
+	for (s = arg; *s; s++) {
+		if (s[0] == '%' && s[1] == 's') {
+			n += (p < nparams) ? strlen(params[p]) : 0;
+			p++, s++;
+		} else {
+			n++;
+			if (s[0] == '%' && s[1] == '%')
+				s++;
+		}
+	}
+	if ((buf = arena_alloc(be_arena, n + 1)) == NULL)
+		return NULL;
+
+	p = *next;
+	for (s = arg, d = buf; *s; s++) {
+		if (s[0] == '%' && s[1] == 's') {
+			if (p < nparams) {
+				memcpy(d, params[p], strlen(params[p]));
+				d += strlen(params[p]);
+			}
+			p++, s++;
+		} else {
+			*d++ = *s;
+			if (s[0] == '%' && s[1] == '%')
+				s++;
+		}
+	}
+	*d = 0;
+	*len = n;
+	*next = p;
+	return buf;
+}
+
+/*
+ * Send the commands of `q', with the parameters filled in, and return
+ * their replies in `replies'. Several commands are pipelined, so they
+ * cost one round trip together. On failure nothing is returned and the
+ * connection is re-established for the next lookup.
+ */
+
+static bool query_run(struct redis_backend *conf, struct redis_query *q,
+		const char **params, int nparams, redisReply **replies)
+{
+	const char *argv[MAXARGS];
+	size_t argvlen[MAXARGS];
+	struct redis_cmd *c;
+	int n, i, p, got = 0;
+	bool ok = true;
+
+	for (n = 0; ok && n < q->ncmds; n++) {
+		c = &q->cmds[n];
+		p = 0;
+		for (i = 0; i < c->argc; i++) {
+			argv[i] = c->argv[i];
+			argvlen[i] = c->argvlen[i];
+			if (c->expand[i] &&
+			    (argv[i] = arg_expand(c->argv[i], params, nparams, &p, &argvlen[i])) == NULL)
+				ok = false;
+		}
+		if (!ok)
+			break;
+		if (q->ncmds == 1) {
+			replies[0] = redisCommandArgv(conf->redis, c->argc, argv, argvlen);
+			got = (replies[0] != NULL);
+			ok = got && conf->redis->err == REDIS_OK;
+			break;
+		}
+		ok = (redisAppendCommandArgv(conf->redis, c->argc, argv, argvlen) == REDIS_OK);
+	}
+	if (ok && q->ncmds > 1) {
+		for (got = 0; got < q->ncmds; got++) {
+			if (redisGetReply(conf->redis, (void **)&replies[got]) != REDIS_OK) {
+				ok = false;
+				break;
+			}
+		}
+	}
+	if (!ok) {
+		for (n = 0; n < got; n++)
+			freeReplyObject(replies[n]);
+		return false;
+	}
+	return true;
+}
 
 static int be_redis_reconnect(struct redis_backend *conf)
 {
+	const char *argv[2];
+	size_t argvlen[2];
+	char dbnum[12];
+	redisReply *r;
+	int rc = 0, n;
+
 	if (conf->redis != NULL) {
 		redisFree(conf->redis);
 		conf->redis = NULL;
@@ -62,22 +240,32 @@ static int be_redis_reconnect(struct redis_backend *conf)
 		     conf->redis->errstr, conf->host, conf->port);
 		return 1;
 	}
+
+	/* AUTH and SELECT in one round trip */
 	if (strlen(conf->dbpass) > 0) {
 		_log(LOG_NOTICE, "Using password protected redis\n");
-		redisReply *r = redisCommand(conf->redis, "AUTH %s", conf->dbpass);
-		if (r == NULL || conf->redis->err != REDIS_OK) {
-			_log(LOG_NOTICE, "Redis authentication error: %s\n", conf->redis->errstr);
-			return 3;
+		argv[0] = "AUTH";	argvlen[0] = 4;
+		argv[1] = conf->dbpass;	argvlen[1] = strlen(conf->dbpass);
+		redisAppendCommandArgv(conf->redis, 2, argv, argvlen);
+	}
+	snprintf(dbnum, sizeof(dbnum), "%d", conf->db);
+	argv[0] = "SELECT";	argvlen[0] = 6;
+	argv[1] = dbnum;	argvlen[1] = strlen(dbnum);
+	redisAppendCommandArgv(conf->redis, 2, argv, argvlen);
+
+	for (n = (strlen(conf->dbpass) > 0) ? 2 : 1; n > 0; n--) {
+		if (redisGetReply(conf->redis, (void **)&r) != REDIS_OK) {
+			_log(LOG_NOTICE, "Redis error: %s\n", conf->redis->errstr);
+			return (n == 2) ? 3 : 2;
+		}
+		if (r->type == REDIS_REPLY_ERROR && rc == 0) {
+			_log(LOG_NOTICE, "Redis %s error: %s\n", (n == 2) ? "authentication" : "SELECT", r->str);
+			rc = (n == 2) ? 3 : 2;
 		}
 		freeReplyObject(r);
 	}
-	redisReply *r = redisCommand(conf->redis, "SELECT %i", conf->db);
-	if (r == NULL || conf->redis->err != REDIS_OK) {
-		return 2;
-	}
-	freeReplyObject(r);
 
-	return 0;
+	return rc;
 }
 
 void *be_redis_init()
@@ -95,13 +283,13 @@ void *be_redis_init()
 		db = "0";
 	if ((password = p_stab("redis_pass")) == NULL)
 		password = "";
-	if ((userquery = p_stab("redis_userquery")) == NULL) {
-		userquery = "";
+	if ((userquery = p_stab("redis_userquery")) == NULL || !*userquery) {
+		userquery = "GET %s";
 	}
 	if ((aclquery = p_stab("redis_aclquery")) == NULL) {
 		aclquery = "";
 	}
-	conf = (struct redis_backend *)malloc(sizeof(struct redis_backend));
+	conf = (struct redis_backend *)calloc(1, sizeof(struct redis_backend));
 	if (conf == NULL)
 		_fatal("Out of memory");
 
@@ -112,9 +300,21 @@ void *be_redis_init()
 	conf->userquery = strdup(userquery);
 	conf->aclquery = strdup(aclquery);
 
+	if (!query_parse(&conf->user, conf->userquery)) {
+		_fatal("Redis: can't use redis_userquery `%s'", conf->userquery);
+		return (NULL);
+	}
+	if (*conf->aclquery && !query_parse(&conf->acl, conf->aclquery)) {
+		_fatal("Redis: can't use redis_aclquery `%s'", conf->aclquery);
+		return (NULL);
+	}
+
 	conf->redis = NULL;
 
 	if (be_redis_reconnect(conf)) {
+		redisFree(conf->redis);
+		query_free(&conf->user);
+		query_free(&conf->acl);
 		free(conf->host);
 		free(conf->userquery);
 		free(conf->dbpass);
@@ -132,6 +332,12 @@ void be_redis_destroy(void *handle)
 	if (conf != NULL) {
 		redisFree(conf->redis);
 		conf->redis = NULL;
+		query_free(&conf->user);
+		query_free(&conf->acl);
+		free(conf->host);
+		free(conf->userquery);
+		free(conf->dbpass);
+		free(conf->aclquery);
 		free(conf);
 	}
 }
@@ -139,30 +345,25 @@ void be_redis_destroy(void *handle)
 int be_redis_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
 {
 	struct redis_backend *conf = (struct redis_backend *)handle;
-
-	redisReply *r;
+	redisReply *r[MAXCMDS];
 	char *pwhash = NULL;
+	int n;
 
 	if (conf == NULL || conf->redis == NULL || username == NULL)
 		return BACKEND_DEFER;
 
-	if (strlen(conf->userquery) == 0) {
-		conf->userquery = "GET %s";
-	}
-	char *query = malloc(strlen(conf->userquery) + strlen(username) + 128);
-	sprintf(query, conf->userquery, username);
-
-	r = redisCommand(conf->redis, query);
-	if (r == NULL || conf->redis->err != REDIS_OK) {
+	if (!query_run(conf, &conf->user, &username, 1, r)) {
 		be_redis_reconnect(conf);
 		return BACKEND_ERROR;
 	}
-	free(query);
 
-	if (r->type == REDIS_REPLY_STRING) {
-		pwhash = strdup(r->str);
+	/* The first command which has the user's hash */
+	for (n = 0; n < conf->user.ncmds; n++) {
+		if (pwhash == NULL && r[n]->type == REDIS_REPLY_STRING) {
+			pwhash = strdup(r[n]->str);
+		}
+		freeReplyObject(r[n]);
 	}
-	freeReplyObject(r);
 
 	*phash = pwhash;
 	return BACKEND_DEFER;
@@ -176,33 +377,31 @@ int be_redis_superuser(void *conf, const char *username)
 int be_redis_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
 	struct redis_backend *conf = (struct redis_backend *)handle;
-
-	redisReply *r;
+	redisReply *r[MAXCMDS];
+	const char *params[2] = {username, topic};
+	int n, answer = 0;
 
 	if (conf == NULL || conf->redis == NULL || username == NULL)
 		return BACKEND_DEFER;
 
-	if (strlen(conf->aclquery) == 0) {
+	if (conf->acl.ncmds == 0) {
 		return BACKEND_ALLOW;
 	}
-	char *query = malloc(strlen(conf->aclquery) + strlen(username) + strlen(topic) + 128);
-	sprintf(query, conf->aclquery, username, topic);
 
-
-	r = redisCommand(conf->redis, query, username, acc);
-	if (r == NULL || conf->redis->err != REDIS_OK) {
+	if (!query_run(conf, &conf->acl, params, 2, r)) {
 		be_redis_reconnect(conf);
 		return BACKEND_ERROR;
 	}
-	free(query);
 
-	int answer = 0;
-	if (r->type == REDIS_REPLY_STRING) {
-		int x = atoi(r->str);
-		if (x >= acc)
-			answer = 1;
+	/* Any of the commands may grant the access */
+	for (n = 0; n < conf->acl.ncmds; n++) {
+		if (r[n]->type == REDIS_REPLY_STRING) {
+			int x = atoi(r[n]->str);
+			if (x >= acc)
+				answer = 1;
+		}
+		freeReplyObject(r[n]);
 	}
-	freeReplyObject(r);
 	return (answer) ? BACKEND_ALLOW : BACKEND_DEFER;
 }
 #endif /* BE_REDIS */
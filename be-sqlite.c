@@ -33,27 +33,275 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "backends.h"
 #include "be-sqlite.h"
 #include "hash.h"
 #include "log.h"
+#include "matcher.h"
+#include "arena.h"
 #include <mosquitto.h>
 
-static bool prepareStatement(struct sqlite_backend *conf)
+#define MAXBACKUPTRIES	(10)	/* copying a database someone writes to */
+
+/*
+ * Statements are prepared once and reused for every call, so tell SQLite
+ * they are long-lived where it supports that.
+ */
+
+static bool prepare(struct sqlite_db *db, const char *sql, sqlite3_stmt **stmt)
+{
+	int rc;
+
+#if SQLITE_VERSION_NUMBER >= 3020000
+	rc = sqlite3_prepare_v3(db->sq, sql, -1, SQLITE_PREPARE_PERSISTENT, stmt, NULL);
+#else
+	rc = sqlite3_prepare_v2(db->sq, sql, -1, stmt, NULL);
+#endif
+	if (rc != SQLITE_OK) {
+		_log(MOSQ_LOG_WARNING, "Can't prepare: %s\n", sqlite3_errmsg(db->sq));
+		*stmt = NULL;
+		return false;
+	}
+	return true;
+}
+
+static bool prepareStatement(struct sqlite_backend *conf, struct sqlite_db *db)
+{
+	return prepare(db, conf->userquery, &db->stmt);
+}
+
+static void db_free(struct sqlite_db *db)
+{
+	struct sqlite_aclentry *e, *tmp;
+
+	HASH_ITER(hh, db->acls, e, tmp) {
+		HASH_DEL(db->acls, e);
+		matcher_free(e->m);
+		free(e->key);
+		free(e);
+	}
+	sqlite3_finalize(db->stmt);
+	sqlite3_finalize(db->superstmt);
+	sqlite3_finalize(db->aclstmt);
+	sqlite3_close(db->sq);
+	free(db);
+}
+
+static void db_release(struct rcu_head *head)
+{
+	db_free((struct sqlite_db *)head);
+}
+
+/*
+ * Copy the database at `dbpath' into a new in-memory one with the backup
+ * API. A writer holding a lock makes the copy wait, then start over.
+ */
+
+static sqlite3 *db_copy(const char *dbpath, char *err, size_t errlen)
 {
-	bool ret;
-	const char *userquery = p_stab("sqliteuserquery");
-	ret = sqlite3_prepare(conf->sq, userquery, strlen(userquery), &conf->stmt, NULL) == SQLITE_OK;
-	if (!ret)
-		_log(MOSQ_LOG_WARNING, "Can't prepare: %s\n", sqlite3_errmsg(conf->sq));
-	return ret;
+	sqlite3 *src = NULL, *dst = NULL;
+	sqlite3_backup *b;
+	int rc = SQLITE_ERROR, tries;
+
+	if (sqlite3_open_v2(dbpath, &src, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK ||
+	    sqlite3_open(":memory:", &dst) != SQLITE_OK) {
+		snprintf(err, errlen, "sqlite: failed to open: %s", dbpath);
+		goto out;
+	}
+	sqlite3_busy_timeout(src, 1000);
+
+	for (tries = 0; tries < MAXBACKUPTRIES; tries++) {
+		if ((b = sqlite3_backup_init(dst, "main", src, "main")) == NULL)
+			break;
+		rc = sqlite3_backup_step(b, -1);
+		sqlite3_backup_finish(b);
+		if (rc != SQLITE_BUSY && rc != SQLITE_LOCKED)
+			break;
+		usleep(100000);
+	}
+	if (rc != SQLITE_DONE)
+		snprintf(err, errlen, "sqlite: can't copy %s: %s", dbpath, sqlite3_errmsg(dst));
+
+  out:
+	sqlite3_close(src);
+	if (rc != SQLITE_DONE) {
+		sqlite3_close(dst);
+		return (NULL);
+	}
+	return (dst);
+}
+
+/*
+ * Open the database, or copy it into memory with `sqlite_memory', and
+ * prepare the statements on it. On error, returns NULL and leaves a
+ * description in `err'.
+ */
+
+static struct sqlite_db *db_open(struct sqlite_backend *conf, char *err, size_t errlen)
+{
+	struct sqlite_db *db = calloc(1, sizeof(struct sqlite_db));
+	int flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_SHAREDCACHE;
+
+	if (db == NULL) {
+		snprintf(err, errlen, "sqlite: out of memory");
+		return (NULL);
+	}
+
+	if (conf->memory) {
+		if ((db->sq = db_copy(conf->dbpath, err, errlen)) == NULL) {
+			free(db);
+			return (NULL);
+		}
+	} else if (sqlite3_open_v2(conf->dbpath, &db->sq, flags, NULL) != SQLITE_OK) {
+		snprintf(err, errlen, "failed to open: %s", conf->dbpath);
+		db_free(db);
+		return (NULL);
+	} else if (conf->mmap_size > 0) {
+		char *pragma = sqlite3_mprintf("PRAGMA mmap_size = %lld", conf->mmap_size);
+
+		sqlite3_exec(db->sq, pragma, NULL, NULL, NULL);
+		sqlite3_free(pragma);
+	}
+
+	if (!prepareStatement(conf, db) && conf->memory) {
+		/* a snapshot won't get better later */
+		snprintf(err, errlen, "sqlite: can't prepare user query on copy of %s", conf->dbpath);
+		db_free(db);
+		return (NULL);
+	}
+	if (conf->superquery)
+		prepare(db, conf->superquery, &db->superstmt);
+	if (conf->aclquery)
+		prepare(db, conf->aclquery, &db->aclstmt);
+	return (db);
+}
+
+static void post_message(struct sqlite_backend *conf, char *msg)
+{
+	free(atomic_exchange(&conf->message, msg));
+}
+
+/*
+ * Current database, valid until the broker thread returns to mosquitto.
+ */
+
+static struct sqlite_db *current(struct sqlite_backend *conf)
+{
+	char *msg;
+
+	if (atomic_load_explicit(&conf->message, memory_order_relaxed) != NULL &&
+	    (msg = atomic_exchange(&conf->message, NULL)) != NULL) {
+		_log(LOG_NOTICE, "%s", msg);
+		free(msg);
+	}
+	return atomic_load_explicit(&conf->db, memory_order_acquire);
+}
+
+/*
+ * Value of PRAGMA data_version on the watching connection, which changes
+ * whenever another connection commits to the database; -1 on error,
+ * e.g. while a writer holds an exclusive lock.
+ */
+
+static long long data_version(sqlite3 *sq)
+{
+	sqlite3_stmt *stmt;
+	long long version = -1;
+
+	if (sqlite3_prepare_v2(sq, "PRAGMA data_version", -1, &stmt, NULL) != SQLITE_OK)
+		return (-1);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	return (version);
+}
+
+/*
+ * (Re)open the connection through which the reloader watches the file
+ * for commits, and note which file it is, so that one renamed over it
+ * is noticed too.
+ */
+
+static bool db_watch(struct sqlite_backend *conf)
+{
+	struct stat st;
+
+	sqlite3_close(conf->watch);
+	conf->watch = NULL;
+	if (stat(conf->dbpath, &st) != 0 ||
+	    sqlite3_open_v2(conf->dbpath, &conf->watch, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+		return false;
+	sqlite3_busy_timeout(conf->watch, 100);
+	conf->dev = st.st_dev;
+	conf->ino = st.st_ino;
+	conf->version = data_version(conf->watch);
+	return true;
+}
+
+static bool db_changed(struct sqlite_backend *conf)
+{
+	struct stat st;
+	long long version;
+
+	if (stat(conf->dbpath, &st) != 0)
+		return false;
+	if (conf->watch == NULL || st.st_dev != conf->dev || st.st_ino != conf->ino)
+		return db_watch(conf);
+	if ((version = data_version(conf->watch)) == -1 || version == conf->version)
+		return false;
+	conf->version = version;
+	return true;
+}
+
+/*
+ * Reloader thread: look for a commit to the database, or a new file in
+ * its place, every `sqlite_reload_interval' seconds, and then copy it
+ * into a new in-memory database
+ * and publish that. The broker thread never waits for the copy or for
+ * locks held by whoever writes the file; the old copy is closed once
+ * the broker thread has moved on (see rcu.h).
+ */
+
+static void *db_reload(void *arg)
+{
+	struct sqlite_backend *conf = (struct sqlite_backend *)arg;
+	struct sqlite_db *db, *old;
+	struct pollfd pfd;
+	char err[512];
+
+	pfd.fd = conf->stopfd[0];
+	pfd.events = POLLIN;
+
+	while (poll(&pfd, 1, conf->reload_interval * 1000) == 0) {
+		/* A change whose copy failed is tried again next time */
+		if (db_changed(conf))
+			conf->pending = true;
+		if (!conf->pending)
+			continue;
+
+		if ((db = db_open(conf, err, sizeof(err))) == NULL) {
+			post_message(conf, strdup(err));
+			continue;
+		}
+		conf->pending = false;
+
+		old = atomic_exchange_explicit(&conf->db, db, memory_order_acq_rel);
+		snprintf(err, sizeof(err), "sqlite: %s reloaded into memory", conf->dbpath);
+		post_message(conf, strdup(err));
+		rcu_retire(&old->rcu, db_release);
+	}
+	return NULL;
 }
 
 void *be_sqlite_init()
 {
 	struct sqlite_backend *conf;
-	int flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_SHAREDCACHE;
-	char *dbpath, *userquery;
+	struct sqlite_db *db;
+	char *dbpath, *userquery, *opt, err[512];
 
 	if ((dbpath = p_stab("dbpath")) == NULL) {
 		_fatal("Mandatory parameter `dbpath' missing");
@@ -63,15 +311,38 @@ void *be_sqlite_init()
 		_fatal("Mandatory parameter `sqliteuserquery' missing");
 		return (NULL);
 	}
-	conf = (struct sqlite_backend *)malloc(sizeof(struct sqlite_backend));
-	conf->stmt = NULL;
+	conf = (struct sqlite_backend *)calloc(1, sizeof(struct sqlite_backend));
+	conf->dbpath = dbpath;
+	conf->userquery = userquery;
+	conf->superquery = p_stab("sqlitesuperquery");
+	conf->aclquery = p_stab("sqliteaclquery");
+	conf->memory = (opt = p_stab("sqlite_memory")) != NULL && !strcmp(opt, "true");
+	if ((opt = p_stab("sqlite_mmap_size")) != NULL)
+		conf->mmap_size = atoll(opt);
+	if ((opt = p_stab("sqlite_reload_interval")) != NULL && conf->memory)
+		conf->reload_interval = atoi(opt);
+	conf->stopfd[0] = conf->stopfd[1] = -1;
+
+	/* watch from before the copy, so no commit goes unnoticed */
+	if (conf->reload_interval > 0)
+		db_watch(conf);
 
-	if (sqlite3_open_v2(dbpath, &conf->sq, flags, NULL) != SQLITE_OK) {
-		_log(MOSQ_LOG_ERR, "failed to open: %s", dbpath);
+	if ((db = db_open(conf, err, sizeof(err))) == NULL) {
+		sqlite3_close(conf->watch);
+		_log(MOSQ_LOG_ERR, "%s", err);
 		free(conf);
 		return (NULL);
 	}
-	prepareStatement(conf);
+	atomic_init(&conf->db, db);
+	atomic_init(&conf->message, NULL);
+
+	if (conf->reload_interval > 0) {
+		if (pipe(conf->stopfd) != 0 ||
+		    pthread_create(&conf->reloader, NULL, db_reload, conf) != 0) {
+			_log(MOSQ_LOG_ERR, "sqlite: cannot start reloader, reloading disabled");
+			conf->reload_interval = 0;
+		}
+	}
 
 	return (conf);
 }
@@ -81,8 +352,17 @@ void be_sqlite_destroy(void *handle)
 	struct sqlite_backend *conf = (struct sqlite_backend *)handle;
 
 	if (conf) {
-		sqlite3_finalize(conf->stmt);
-		sqlite3_close(conf->sq);
+		if (conf->reload_interval > 0) {
+			if (write(conf->stopfd[1], "", 1) == 1)
+				pthread_join(conf->reloader, NULL);
+		}
+		if (conf->stopfd[0] != -1) {
+			close(conf->stopfd[0]);
+			close(conf->stopfd[1]);
+		}
+		sqlite3_close(conf->watch);
+		db_free(atomic_load(&conf->db));
+		free(atomic_load(&conf->message));
 		free(conf);
 	}
 }
@@ -90,69 +370,247 @@ void be_sqlite_destroy(void *handle)
 int be_sqlite_getuser(void *handle, const char *username, const char *password, char **phash, const char *clientid)
 {
 	struct sqlite_backend *conf = (struct sqlite_backend *)handle;
+	struct sqlite_db *db;
 	int res, retries;
 	char *value = NULL, *v;
 	int result = BACKEND_DEFER;
 
 	if (!conf)
 		return BACKEND_DEFER;
+	db = current(conf);
 
 	for (retries = 5; --retries > 0 && value == NULL;) {
-		if (conf->stmt == NULL)
-			if (!prepareStatement(conf))
+		if (db->stmt == NULL)
+			if (!prepareStatement(conf, db))
 				return BACKEND_ERROR;
 
-		res = sqlite3_reset(conf->stmt);
+		res = sqlite3_reset(db->stmt);
 		if (res != SQLITE_OK) {
-			_log(MOSQ_LOG_ERR, "statement reset: %s", sqlite3_errmsg(conf->sq));
+			_log(MOSQ_LOG_ERR, "statement reset: %s", sqlite3_errmsg(db->sq));
 			result = BACKEND_ERROR;
 			goto out;
 		}
-		res = sqlite3_clear_bindings(conf->stmt);
+		res = sqlite3_clear_bindings(db->stmt);
 		if (res != SQLITE_OK) {
-			_log(MOSQ_LOG_ERR, "bindings clear: %s", sqlite3_errmsg(conf->sq));
+			_log(MOSQ_LOG_ERR, "bindings clear: %s", sqlite3_errmsg(db->sq));
 			result = BACKEND_ERROR;
 			goto out;
 		}
-		res = sqlite3_bind_text(conf->stmt, 1, username, -1, SQLITE_STATIC);
+		res = sqlite3_bind_text(db->stmt, 1, username, -1, SQLITE_STATIC);
 		if (res != SQLITE_OK) {
-			_log(MOSQ_LOG_ERR, "Can't bind: %s", sqlite3_errmsg(conf->sq));
+			_log(MOSQ_LOG_ERR, "Can't bind: %s", sqlite3_errmsg(db->sq));
 			result = BACKEND_ERROR;
 			goto out;
 		}
-		res = sqlite3_step(conf->stmt);
+		res = sqlite3_step(db->stmt);
 
 		switch (res) {
 		case SQLITE_ROW:
-			v = (char *)sqlite3_column_text(conf->stmt, 0);
+			v = (char *)sqlite3_column_text(db->stmt, 0);
 			if (v)
 				value = strdup(v);
 			break;
+		case SQLITE_DONE:
+			goto out;
 		case SQLITE_ERROR:
-			sqlite3_finalize(conf->stmt);
-			conf->stmt = NULL;
+			sqlite3_finalize(db->stmt);
+			db->stmt = NULL;
 			result = BACKEND_ERROR;
 			break;
 		default:
-			_log(MOSQ_LOG_ERR, "step: %s", sqlite3_errmsg(conf->sq));
+			_log(MOSQ_LOG_ERR, "step: %s", sqlite3_errmsg(db->sq));
 			break;
 		}
 	}
 
 out:
-	sqlite3_reset(conf->stmt);
+	sqlite3_reset(db->stmt);
 
 	*phash = value;
 	return result;
 }
 
+/*
+ * Ready the prepared statement in `*stmt' for a new execution with the
+ * username bound to the first parameter, preparing `sql' if needed.
+ */
+
+static bool bind_user(struct sqlite_db *db, const char *sql, sqlite3_stmt **stmt, const char *username)
+{
+	if (*stmt == NULL && !prepare(db, sql, stmt))
+		return false;
+
+	sqlite3_reset(*stmt);
+	sqlite3_clear_bindings(*stmt);
+	if (sqlite3_bind_text(*stmt, 1, username, -1, SQLITE_STATIC) != SQLITE_OK) {
+		_log(MOSQ_LOG_ERR, "Can't bind: %s", sqlite3_errmsg(db->sq));
+		return false;
+	}
+	return true;
+}
+
+/*
+ * A failed step may mean the schema changed under us; prepare the
+ * statement again on next use.
+ */
+
+static void step_failed(struct sqlite_db *db, sqlite3_stmt **stmt)
+{
+	_log(MOSQ_LOG_ERR, "step: %s", sqlite3_errmsg(db->sq));
+	sqlite3_finalize(*stmt);
+	*stmt = NULL;
+}
+
+/*
+ * The superquery is called with the username bound to its parameter and
+ * returns a count; the user is a superuser if it is greater than 0.
+ */
+
 int be_sqlite_superuser(void *handle, const char *username)
 {
-	return BACKEND_DEFER;
+	struct sqlite_backend *conf = (struct sqlite_backend *)handle;
+	struct sqlite_db *db;
+	int result = BACKEND_DEFER;
+
+	if (!conf || !conf->superquery)
+		return BACKEND_DEFER;
+	db = current(conf);
+
+	if (!bind_user(db, conf->superquery, &db->superstmt, username))
+		return BACKEND_ERROR;
+
+	switch (sqlite3_step(db->superstmt)) {
+	case SQLITE_ROW:
+		if (sqlite3_column_int(db->superstmt, 0) > 0)
+			result = BACKEND_ALLOW;
+		break;
+	case SQLITE_DONE:
+		break;
+	default:
+		step_failed(db, &db->superstmt);
+		return BACKEND_ERROR;
+	}
+
+	sqlite3_reset(db->superstmt);
+	return result;
 }
 
 int be_sqlite_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc)
 {
-	return BACKEND_ALLOW;
+	return be_sqlite_aclcheck_rule(handle, clientid, username, topic, acc, NULL);
+}
+
+/*
+ * The aclquery is called with the username bound to its first parameter
+ * and, if it has a second, the requested access bound to that. Each row
+ * is a topic filter granting that access; they are compiled into a
+ * matcher, so the topic is checked against all of them in one pass.
+ */
+
+static struct matcher *sqlite_compile(struct sqlite_backend *conf, struct sqlite_db *db, const char *username, int acc)
+{
+	struct matcher *m;
+	int res;
+
+	if (!bind_user(db, conf->aclquery, &db->aclstmt, username))
+		return (NULL);
+	if (sqlite3_bind_parameter_count(db->aclstmt) >= 2 &&
+	    sqlite3_bind_int(db->aclstmt, 2, acc) != SQLITE_OK) {
+		_log(MOSQ_LOG_ERR, "Can't bind: %s", sqlite3_errmsg(db->sq));
+		return (NULL);
+	}
+
+	if ((m = matcher_new(username)) == NULL)
+		return (NULL);
+
+	while ((res = sqlite3_step(db->aclstmt)) == SQLITE_ROW) {
+		const char *v = (const char *)sqlite3_column_text(db->aclstmt, 0);
+
+		if (v && matcher_add(m, v, acc) != 0) {
+			res = SQLITE_NOMEM;
+			break;
+		}
+	}
+
+	if (res != SQLITE_DONE) {
+		step_failed(db, &db->aclstmt);
+		matcher_free(m);
+		return (NULL);
+	}
+	sqlite3_reset(db->aclstmt);
+	_log(LOG_DEBUG, "  sqlite: compiled %d rule(s) for %s", matcher_count(m), username);
+	return (m);
+}
+
+/*
+ * Return the user's compiled matcher for `acc'. An in-memory copy of the
+ * database doesn't change, so its matchers are kept with it and go when
+ * it is replaced; when the cache is full the least recently compiled
+ * entry goes. A database used in place may change under us, so there
+ * the matcher is compiled for the one check and `*transient' is set.
+ */
+
+static struct matcher *sqlite_matcher(struct sqlite_backend *conf, struct sqlite_db *db, const char *username, int acc, bool *transient)
+{
+	struct sqlite_aclentry *e;
+	char *key;
+
+	*transient = !conf->memory;
+	if (*transient)
+		return sqlite_compile(conf, db, username, acc);
+
+	if ((key = arena_sprintf(be_arena, "%d:%s", acc, username)) == NULL)
+		return (NULL);
+	HASH_FIND_STR(db->acls, key, e);
+	if (e != NULL)
+		return (e->m);
+
+	if ((e = malloc(sizeof(struct sqlite_aclentry))) == NULL)
+		return (NULL);
+	if ((e->m = sqlite_compile(conf, db, username, acc)) == NULL) {
+		free(e);
+		return (NULL);
+	}
+	if ((e->key = strdup(key)) == NULL) {
+		matcher_free(e->m);
+		free(e);
+		return (NULL);
+	}
+
+	if (HASH_COUNT(db->acls) >= MAXSQLITEACLS) {
+		struct sqlite_aclentry *old = db->acls;	/* insertion order */
+
+		HASH_DEL(db->acls, old);
+		matcher_free(old->m);
+		free(old->key);
+		free(old);
+	}
+	HASH_ADD_KEYPTR(hh, db->acls, e->key, strlen(e->key), e);
+	return (e->m);
+}
+
+int be_sqlite_aclcheck_rule(void *handle, const char *clientid, const char *username, const char *topic, int acc, char **rule)
+{
+	struct sqlite_backend *conf = (struct sqlite_backend *)handle;
+	struct matcher *m;
+	bool transient;
+	int match = BACKEND_DEFER;
+
+	if (!conf)
+		return BACKEND_DEFER;
+	if (!conf->aclquery)
+		return BACKEND_ALLOW;
+
+	if ((m = sqlite_matcher(conf, current(conf), username, acc, &transient)) == NULL)
+		return BACKEND_ERROR;
+
+	if (matcher_match(m, clientid, topic, acc, rule))
+		match = BACKEND_ALLOW;
+	_log(LOG_DEBUG, "  sqlite: %d rule(s) for %s, topic %s: %d",
+	     matcher_count(m), username, topic, match);
+
+	if (transient)
+		matcher_free(m);
+	return match;
 }
 #endif /* BE_SQLITE */
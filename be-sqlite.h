@@ -29,11 +29,53 @@
 
 #ifdef BE_SQLITE
 
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
 #include <sqlite3.h>
+#include "rcu.h"
+#include "uthash.h"
 
-struct sqlite_backend {
+#define MAXSQLITEACLS	(10000)		/* users with a compiled matcher */
+
+struct sqlite_aclentry {
+	char *key;			/* "access:username" */
+	struct matcher *m;
+	UT_hash_handle hh;
+};
+
+/*
+ * The connection and its statements; with `sqlite_memory', an in-memory
+ * copy of the database which is replaced as a whole when the file changes.
+ */
+
+struct sqlite_db {
+	struct rcu_head rcu;		/* must be first */
 	sqlite3 *sq;
 	sqlite3_stmt *stmt;
+	sqlite3_stmt *superstmt;
+	sqlite3_stmt *aclstmt;
+	struct sqlite_aclentry *acls;	/* compiled aclquery rows, memory copies only */
+};
+
+struct sqlite_backend {
+	_Atomic(struct sqlite_db *) db;
+	char *dbpath;
+	char *userquery;
+	char *superquery;
+	char *aclquery;
+	bool memory;			/* work on a copy in memory */
+	long long mmap_size;		/* else, PRAGMA mmap_size */
+	int reload_interval;		/* seconds between checks; 0: no reloading */
+	sqlite3 *watch;			/* the reloader's view of the file */
+	dev_t dev;
+	ino_t ino;
+	long long version;		/* PRAGMA data_version */
+	bool pending;			/* a change not copied yet */
+	pthread_t reloader;
+	int stopfd[2];
+	_Atomic(char *) message;	/* from the reloader, logged by the broker thread */
 };
 
 void *be_sqlite_init();
@@ -42,4 +84,5 @@ int be_sqlite_getuser(void *handle, const char *username, const char *password,
 int be_sqlite_access(void *handle, const char *username, char *topic);
 int be_sqlite_superuser(void *handle, const char *username);
 int be_sqlite_aclcheck(void *handle, const char *clientid, const char *username, const char *topic, int acc);
+int be_sqlite_aclcheck_rule(void *handle, const char *clientid, const char *username, const char *topic, int acc, char **rule);
 #endif /* BE_SQLITE */
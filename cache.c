@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <stdatomic.h>
 #include <mosquitto.h>
 #include "userdata.h"
 #include "cache.h"
@@ -38,31 +39,54 @@
 #include <openssl/sha.h>
 #include "uthash.h"
 #include "log.h"
+#include "arena.h"
+
+/*
+ * The digest and its context are looked up/allocated once and reused for
+ * every key; all cache calls come from the broker thread.
+ */
 
 static unsigned int sha_hash(const char *data, size_t size, unsigned char *out)
 {
 	unsigned int md_len = -1;
-	const EVP_MD *md = EVP_get_digestbyname("SHA1");
+	static const EVP_MD *md = NULL;
+	static EVP_MD_CTX *mdctx = NULL;
 
-	if (md != NULL) {
+	if (md == NULL)
+		md = EVP_get_digestbyname("SHA1");
+
+	if (md != NULL && mdctx == NULL) {
 #if OPENSSL_VERSION_NUMBER < 0x10100000 || defined(LIBRESSL_VERSION_NUMBER)
-		EVP_MD_CTX *mdctx = EVP_MD_CTX_create();
+		mdctx = EVP_MD_CTX_create();
 #else
-		EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+		mdctx = EVP_MD_CTX_new();
 #endif
-		EVP_MD_CTX_init(mdctx);
+	}
+
+	if (mdctx != NULL) {
 		EVP_DigestInit_ex(mdctx, md, NULL);
 		EVP_DigestUpdate(mdctx, data, size);
 		EVP_DigestFinal_ex(mdctx, out, &md_len);
-#if OPENSSL_VERSION_NUMBER < 0x10100000 || defined(LIBRESSL_VERSION_NUMBER)
-		EVP_MD_CTX_destroy(mdctx);
-#else
-		EVP_MD_CTX_free(mdctx);
-#endif
 	}
 	return md_len;
 }
 
+/*
+ * Cache entries remember a hash of their username so that a back-end can
+ * invalidate one user's entries; a collision only drops a few more.
+ */
+
+static unsigned int user_hash(const char *username)
+{
+	unsigned int h = 2166136261U;
+
+	while (*username) {
+		h ^= (unsigned char)*username++;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
 static void hexify(const char *data, char *hex)
 {
 	unsigned char hashdata[SHA_DIGEST_LENGTH];
@@ -110,10 +134,8 @@ void acl_cache(const char *clientid, const char *username, const char *topic, in
 
 	now = time(NULL);
 
-	data = malloc(strlen(clientid) + strlen(username) + strlen(topic) + 20);
-	sprintf(data, "%s:%s:%s:%d", clientid, username, topic, access);
+	data = arena_sprintf(ud->arena, "%s:%s:%s:%d", clientid, username, topic, access);
 	hexify(data, hex);
-	free(data);
 
 	HASH_FIND_STR(ud->aclcache, hex, a);
 	if (a) {
@@ -127,6 +149,7 @@ void acl_cache(const char *clientid, const char *username, const char *topic, in
 	} else {
 		a = (struct cacheentry *)malloc(sizeof(struct cacheentry));
 		strcpy(a->hex, hex);
+		a->uhash = user_hash(username);
 		a->granted = granted;
 		a->expire_time = now + cacheseconds;
 		HASH_ADD_STR(ud->aclcache, hex, a);
@@ -163,10 +186,8 @@ int acl_cache_q(const char *clientid, const char *username, const char *topic, i
 		return (MOSQ_ERR_UNKNOWN);
 	}
 
-	data = malloc(strlen(clientid) + strlen(username) + strlen(topic) + 20);
-	sprintf(data, "%s:%s:%s:%d", clientid, username, topic, access);
+	data = arena_sprintf(ud->arena, "%s:%s:%s:%d", clientid, username, topic, access);
 	hexify(data, hex);
-	free(data);
 
 	HASH_FIND_STR(ud->aclcache, hex, a);
 	if (a) {
@@ -184,6 +205,148 @@ int acl_cache_q(const char *clientid, const char *username, const char *topic, i
 	return (granted);
 }
 
+void acl_cache_rule_free(struct rulecacheentry *r)
+{
+	struct cacherule *cr, *next;
+
+	for (cr = r->rules; cr != NULL; cr = next) {
+		next = cr->next;
+		free(cr->rule);
+		free(cr);
+	}
+	free(r);
+}
+
+/*
+ * Drop expired filters from `r'. Returns the number of filters left.
+ */
+
+static int rule_expire(struct rulecacheentry *r, time_t now)
+{
+	struct cacherule **crp, *cr;
+	int n = 0;
+
+	for (crp = &r->rules; (cr = *crp) != NULL; ) {
+		if (now > cr->expire_time) {
+			_log(LOG_DEBUG, " Expired rule [%s] in [%s]", cr->rule, r->hex);
+			*crp = cr->next;
+			free(cr->rule);
+			free(cr);
+		} else {
+			crp = &cr->next;
+			n++;
+		}
+	}
+	return (n);
+}
+
+/*
+ * A back-end granted `access' to (clientid, username) by way of the topic
+ * filter `rule'. Remember the filter so that any other topic it matches is
+ * granted from cache without asking the back-ends again.
+ */
+
+void acl_cache_rule(const char *clientid, const char *username, const char *rule, int access, void *userdata)
+{
+	char *data;
+	char hex[SHA_DIGEST_LENGTH * 2 + 1];
+	struct rulecacheentry *r, *tmp;
+	struct cacherule *cr;
+	struct userdata *ud = (struct userdata *)userdata;
+	time_t cacheseconds = ud->acl_cacheseconds;
+	time_t now;
+
+	if (ud->acl_cacheseconds <= 0) {
+		return;
+	}
+
+	if (ud->acl_cachejitter > 0) {
+		cacheseconds += rand() * (ud->acl_cachejitter * 2) / RAND_MAX - ud->acl_cachejitter;
+		if (cacheseconds <= 0) {
+			return;
+		}
+	}
+
+	if (!clientid || !username || !rule || !*rule) {
+		return;
+	}
+
+	now = time(NULL);
+
+	data = arena_sprintf(ud->arena, "%s:%s:%d", clientid, username, access);
+	hexify(data, hex);
+
+	HASH_FIND_STR(ud->rulecache, hex, r);
+	if (r == NULL) {
+		r = (struct rulecacheentry *)malloc(sizeof(struct rulecacheentry));
+		strcpy(r->hex, hex);
+		r->uhash = user_hash(username);
+		r->rules = NULL;
+		HASH_ADD_STR(ud->rulecache, hex, r);
+	}
+
+	for (cr = r->rules; cr != NULL; cr = cr->next) {
+		if (strcmp(cr->rule, rule) == 0)
+			break;
+	}
+	if (cr == NULL) {
+		cr = (struct cacherule *)malloc(sizeof(struct cacherule));
+		cr->rule = strdup(rule);
+		cr->next = r->rules;
+		r->rules = cr;
+	}
+	cr->expire_time = now + cacheseconds;
+	_log(LOG_DEBUG, " Cached  rule [%s] in [%s] for (%s,%s,%d)", rule, hex, clientid, username, access);
+
+	HASH_ITER(hh, ud->rulecache, r, tmp) {
+		if (rule_expire(r, now) == 0) {
+			HASH_DEL(ud->rulecache, r);
+			acl_cache_rule_free(r);
+		}
+	}
+}
+
+int acl_cache_rule_q(const char *clientid, const char *username, const char *topic, int access, void *userdata)
+{
+	char *data;
+	char hex[SHA_DIGEST_LENGTH * 2 + 1];
+	struct rulecacheentry *r;
+	struct cacherule *cr;
+	struct userdata *ud = (struct userdata *)userdata;
+	bool bf;
+
+	if (ud->acl_cacheseconds <= 0 || ud->rulecache == NULL) {
+		return (MOSQ_ERR_UNKNOWN);
+	}
+
+	if (!clientid || !username || !topic) {
+		return (MOSQ_ERR_UNKNOWN);
+	}
+
+	data = arena_sprintf(ud->arena, "%s:%s:%d", clientid, username, access);
+	hexify(data, hex);
+
+	HASH_FIND_STR(ud->rulecache, hex, r);
+	if (r == NULL) {
+		return (MOSQ_ERR_UNKNOWN);
+	}
+
+	if (rule_expire(r, time(NULL)) == 0) {
+		HASH_DEL(ud->rulecache, r);
+		acl_cache_rule_free(r);
+		return (MOSQ_ERR_UNKNOWN);
+	}
+
+	for (cr = r->rules; cr != NULL; cr = cr->next) {
+		if (t_matches(cr->rule, topic, &bf) == MOSQ_ERR_SUCCESS && bf) {
+			_log(LOG_DEBUG, " Rule [%s] covers %s for (%s,%s,%d)", cr->rule, topic, clientid, username, access);
+			return (MOSQ_ERR_SUCCESS);
+		}
+	}
+
+	return (MOSQ_ERR_UNKNOWN);
+}
+
 /* granted is what Mosquitto auth-plug actually granted
  */
 
@@ -213,10 +376,8 @@ void auth_cache(const char *username, const char *password, int granted, void *u
 
 	now = time(NULL);
 
-	data = malloc(strlen(username) + strlen(password) + 2);
-	sprintf(data, "%s:%s", username, password);
+	data = arena_sprintf(ud->arena, "%s:%s", username, password);
 	hexify(data, hex);
-	free(data);
 
 	HASH_FIND_STR(ud->authcache, hex, a);
 	if (a) {
@@ -230,6 +391,7 @@ void auth_cache(const char *username, const char *password, int granted, void *u
 	} else {
 		a = (struct cacheentry *)malloc(sizeof(struct cacheentry));
 		strcpy(a->hex, hex);
+		a->uhash = user_hash(username);
 		a->granted = granted;
 		a->expire_time = now + cacheseconds;
 
@@ -268,10 +430,8 @@ int auth_cache_q(const char *username, const char *password, void *userdata)
 		return (MOSQ_ERR_UNKNOWN);
 	}
 
-	data = malloc(strlen(username) + strlen(password) + 2);
-	sprintf(data, "%s:%s", username, password);
+	data = arena_sprintf(ud->arena, "%s:%s", username, password);
 	hexify(data, hex);
-	free(data);
 
 	HASH_FIND_STR(ud->authcache, hex, a);
 	if (a) {
@@ -286,3 +446,151 @@ int auth_cache_q(const char *username, const char *password, void *userdata)
 
 	return granted;
 }
+
+void proven_free(struct cliententry *e)
+{
+	struct provenfilter *pf, *next;
+
+	for (pf = e->proven; pf != NULL; pf = next) {
+		next = pf->next;
+		free(pf->filter);
+		free(pf);
+	}
+	e->proven = NULL;
+	e->nproven = 0;
+}
+
+/*
+ * Invalidations requested by back-end threads (e.g. after reloading their
+ * data), applied by the broker thread which owns the caches.
+ */
+
+struct invalidation {
+	struct invalidation *next;
+	char *username;			/* NULL: everything */
+};
+
+static _Atomic(struct invalidation *) invalidations = NULL;
+
+/*
+ * Forget everything cached about `username', or about all users if it is
+ * NULL. May be called from any thread; takes effect at the start of the
+ * next plugin call.
+ */
+
+void cache_invalidate(const char *username)
+{
+	struct invalidation *inv, *old;
+
+	if ((inv = (struct invalidation *)malloc(sizeof(struct invalidation))) == NULL)
+		return;
+	inv->username = username ? strdup(username) : NULL;
+	if (username && inv->username == NULL) {
+		free(inv);
+		return;
+	}
+
+	old = atomic_load_explicit(&invalidations, memory_order_relaxed);
+	do {
+		inv->next = old;
+	} while (!atomic_compare_exchange_weak_explicit(&invalidations, &old, inv,
+			memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * Usernames (by hash) invalidated by one drain of the queue
+ */
+
+struct uhashentry {
+	unsigned int uhash;
+	UT_hash_handle hh;
+};
+
+static int doomed(struct uhashentry *set, unsigned int uhash)
+{
+	struct uhashentry *u;
+
+	if (set == NULL)	/* everything */
+		return (1);
+	HASH_FIND_INT(set, &uhash, u);
+	return (u != NULL);
+}
+
+static void purge(struct cacheentry **cache, struct uhashentry *set)
+{
+	struct cacheentry *a, *tmp;
+
+	HASH_ITER(hh, *cache, a, tmp) {
+		if (doomed(set, a->uhash)) {
+			HASH_DEL(*cache, a);
+			free(a);
+		}
+	}
+}
+
+/*
+ * Apply the queued invalidations: collect them first, so that however
+ * many there are, each cache is walked only once.
+ */
+
+void cache_invalidate_drain(void *userdata)
+{
+	struct userdata *ud = (struct userdata *)userdata;
+	struct invalidation *inv, *next;
+	struct rulecacheentry *r, *rtmp;
+	struct cliententry *e, *etmp;
+	struct uhashentry *set = NULL, *u, *utmp;
+	unsigned int uhash;
+	int all = 0, n = 0;
+
+	if (atomic_load_explicit(&invalidations, memory_order_relaxed) == NULL)
+		return;
+
+	inv = atomic_exchange_explicit(&invalidations, NULL, memory_order_acquire);
+	for (; inv != NULL; inv = next) {
+		next = inv->next;
+		if (inv->username == NULL) {
+			all = 1;
+		} else if (!all) {
+			uhash = user_hash(inv->username);
+			HASH_FIND_INT(set, &uhash, u);
+			if (u == NULL && (u = (struct uhashentry *)malloc(sizeof(struct uhashentry))) != NULL) {
+				u->uhash = uhash;
+				HASH_ADD_INT(set, uhash, u);
+				n++;
+			} else if (u == NULL) {
+				all = 1;	/* out of memory: forget too much rather than too little */
+			}
+		}
+		free(inv->username);
+		free(inv);
+	}
+	if (all) {
+		HASH_ITER(hh, set, u, utmp) {
+			HASH_DEL(set, u);
+			free(u);
+		}
+	}
+
+	if (all)
+		_log(LOG_DEBUG, " Invalidate cache for all users");
+	else
+		_log(LOG_DEBUG, " Invalidate cache for %d user(s)", n);
+	purge(&ud->aclcache, set);
+	purge(&ud->authcache, set);
+	HASH_ITER(hh, ud->rulecache, r, rtmp) {
+		if (doomed(set, r->uhash)) {
+			HASH_DEL(ud->rulecache, r);
+			acl_cache_rule_free(r);
+		}
+	}
+	HASH_ITER(hh, ud->clients, e, etmp) {
+		if (set == NULL || (e->username && doomed(set, user_hash(e->username))))
+			proven_free(e);
+	}
+
+	HASH_ITER(hh, set, u, utmp) {
+		HASH_DEL(set, u);
+		free(u);
+	}
+}
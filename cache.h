@@ -36,15 +36,44 @@
 
 struct cacheentry {
         char hex[SHA_DIGEST_LENGTH * 2 + 1];    /* key within struct */
+        unsigned int uhash;                     /* of the username, for invalidation */
         int granted;
         time_t expire_time;
         UT_hash_handle hh;
 };
 
+/*
+ * Filter-scoped ACL grants: one entry per (clientid, username, access),
+ * holding the list of topic filters a back-end reported as granting it.
+ */
+
+struct cacherule {
+	struct cacherule *next;
+	char *rule;
+	time_t expire_time;
+};
+
+struct rulecacheentry {
+	char hex[SHA_DIGEST_LENGTH * 2 + 1];    /* key within struct */
+	unsigned int uhash;
+	struct cacherule *rules;
+	UT_hash_handle hh;
+};
+
 void acl_cache(const char *clientid, const char *username, const char *topic, int access, int granted, void *userdata);
 int acl_cache_q(const char *clientid, const char *username, const char *topic, int access, void *userdata);
 
+void acl_cache_rule(const char *clientid, const char *username, const char *rule, int access, void *userdata);
+int acl_cache_rule_q(const char *clientid, const char *username, const char *topic, int access, void *userdata);
+void acl_cache_rule_free(struct rulecacheentry *r);
+
 void auth_cache(const char *username, const char *password, int granted, void *userdata);
 int auth_cache_q(const char *username, const char *password, void *userdata);
 
+struct cliententry;
+void proven_free(struct cliententry *e);
+
+void cache_invalidate(const char *username);
+void cache_invalidate_drain(void *userdata);
+
 #endif
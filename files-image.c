@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2013 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "files-image.h"
+
+/*
+ * FNV-1a, then mixed per displacement with the splitmix64 finaliser so
+ * that one string hash serves every displacement tried.
+ */
+
+uint64_t fi_hash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+static uint64_t mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return (x);
+}
+
+uint32_t fi_bucket(uint64_t h, uint32_t nbuckets)
+{
+	return (mix(h) % nbuckets);
+}
+
+uint32_t fi_slot(uint64_t h, uint32_t disp, uint32_t nslots)
+{
+	return (mix(h + (disp + 1) * 0x9e3779b97f4a7c15ULL) % nslots);
+}
+
+static int in_image(const struct fi_header *hdr, uint64_t off, uint64_t count, size_t elsize)
+{
+	return (off <= hdr->size && count <= (hdr->size - off) / elsize && off % 4 == 0);
+}
+
+/*
+ * Check every offset in the image once, so that lookups need no bounds
+ * checks of their own.
+ */
+
+static const char *validate(struct fimage *fi)
+{
+	const struct fi_header *hdr = fi->hdr;
+	uint32_t n;
+
+	if (fi->size < sizeof(struct fi_header) || hdr->magic != FI_MAGIC)
+		return ("not an image (or built on a host of other byte order)");
+	if (hdr->version != FI_VERSION)
+		return ("unsupported image version");
+	if (hdr->size != fi->size)
+		return ("truncated image");
+	if (hdr->nbuckets == 0 || hdr->nslots == 0)
+		return ("empty hash table");
+	if (!in_image(hdr, hdr->off_disp, hdr->nbuckets, sizeof(uint32_t)) ||
+	    !in_image(hdr, hdr->off_slots, hdr->nslots, sizeof(uint32_t)) ||
+	    !in_image(hdr, hdr->off_users, hdr->nusers, sizeof(struct fi_user)) ||
+	    !in_image(hdr, hdr->off_rules, hdr->nrules, sizeof(struct fi_rule)) ||
+	    hdr->off_strings > hdr->size || hdr->strings_size > hdr->size - hdr->off_strings)
+		return ("section out of bounds");
+	if (hdr->strings_size == 0 || fi->strings[hdr->strings_size - 1] != '\0')
+		return ("unterminated string table");
+	if (hdr->global_first > hdr->nrules || hdr->global_count > hdr->nrules - hdr->global_first)
+		return ("bad global rules");
+
+	for (n = 0; n < hdr->nslots; n++) {
+		if (fi->slots[n] != FI_NONE && fi->slots[n] >= hdr->nusers)
+			return ("bad slot");
+	}
+	for (n = 0; n < hdr->nusers; n++) {
+		const struct fi_user *u = &fi->users[n];
+
+		if (u->name >= hdr->strings_size ||
+		    (u->password != FI_NONE && u->password >= hdr->strings_size) ||
+		    u->rule_first > hdr->nrules || u->rule_count > hdr->nrules - u->rule_first)
+			return ("bad user");
+	}
+	for (n = 0; n < hdr->nrules; n++) {
+		if (fi->rules[n].topic >= hdr->strings_size)
+			return ("bad rule");
+	}
+	return (NULL);
+}
+
+struct fimage *fimage_open(const char *path, const char **errstr)
+{
+	struct fimage *fi;
+	struct stat st;
+	int fd;
+
+	*errstr = NULL;
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		*errstr = "cannot open";
+		if (fd != -1)
+			close(fd);
+		return (NULL);
+	}
+
+	if ((fi = calloc(1, sizeof(struct fimage))) == NULL) {
+		close(fd);
+		*errstr = "out of memory";
+		return (NULL);
+	}
+	fi->size = st.st_size;
+	fi->base = (fi->size == 0) ? MAP_FAILED : mmap(NULL, fi->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (fi->base == MAP_FAILED) {
+		*errstr = "cannot map";
+		free(fi);
+		return (NULL);
+	}
+
+	fi->hdr = (const struct fi_header *)fi->base;
+	if (fi->size >= sizeof(struct fi_header) && fi->hdr->magic == FI_MAGIC && fi->hdr->size == fi->size &&
+	    fi->hdr->off_strings <= fi->size) {
+		const char *b = (const char *)fi->base;
+
+		fi->disp = (const uint32_t *)(b + fi->hdr->off_disp);
+		fi->slots = (const uint32_t *)(b + fi->hdr->off_slots);
+		fi->users = (const struct fi_user *)(b + fi->hdr->off_users);
+		fi->rules = (const struct fi_rule *)(b + fi->hdr->off_rules);
+		fi->strings = b + fi->hdr->off_strings;
+	}
+	if ((*errstr = validate(fi)) != NULL) {
+		fimage_close(fi);
+		return (NULL);
+	}
+	return (fi);
+}
+
+void fimage_close(struct fimage *fi)
+{
+	if (fi == NULL)
+		return;
+	munmap(fi->base, fi->size);
+	free(fi);
+}
+
+const struct fi_user *fimage_user(const struct fimage *fi, const char *username)
+{
+	const struct fi_header *hdr = fi->hdr;
+	uint64_t h = fi_hash(username);
+	uint32_t idx;
+
+	idx = fi->slots[fi_slot(h, fi->disp[fi_bucket(h, hdr->nbuckets)], hdr->nslots)];
+	if (idx == FI_NONE || strcmp(fimage_str(fi, fi->users[idx].name), username) != 0)
+		return (NULL);
+	return (&fi->users[idx]);
+}
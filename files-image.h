@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2013 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef __FILES_IMAGE_H
+# define __FILES_IMAGE_H
+
+/*
+ * Compiled form of a password_file and acl_file pair, as written by
+ * mkfimage and mmap()ed read-only by the files back-end. All integers are
+ * in host byte order (an image is refused by a host of the other order)
+ * and all strings are offsets into a table of NUL-terminated strings.
+ *
+ * Users are found through a hash-and-displace perfect hash: the name's
+ * hash picks a bucket, the bucket's displacement picks the slot, and the
+ * slot holds the user's index. Each user points at a contiguous run of
+ * ACL rules; the rules of `pattern' lines (and of `topic' lines before
+ * the first `user' line) form the global run.
+ */
+
+#define FI_MAGIC	(0x4946514dU)	/* "MQFI" */
+#define FI_VERSION	(1)
+#define FI_NONE		(0xffffffffU)
+
+#define FI_READ		(0x01)
+#define FI_WRITE	(0x02)
+
+#define FI_EXPAND	(0x01)		/* topic contains %c or %u */
+
+struct fi_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;			/* of the whole image */
+	uint32_t nusers;
+	uint32_t nbuckets;
+	uint32_t nslots;
+	uint32_t nrules;
+	uint32_t global_first;
+	uint32_t global_count;
+	uint32_t acl_checks;		/* an acl_file was compiled in */
+	uint32_t pad;
+	uint64_t off_disp;		/* uint32_t[nbuckets] */
+	uint64_t off_slots;		/* uint32_t[nslots] */
+	uint64_t off_users;		/* struct fi_user[nusers] */
+	uint64_t off_rules;		/* struct fi_rule[nrules] */
+	uint64_t off_strings;
+	uint64_t strings_size;
+};
+
+struct fi_user {
+	uint32_t name;
+	uint32_t password;		/* FI_NONE if only in acl_file */
+	uint32_t rule_first;
+	uint32_t rule_count;
+};
+
+struct fi_rule {
+	uint32_t topic;
+	uint8_t access;			/* FI_READ | FI_WRITE */
+	uint8_t flags;			/* FI_EXPAND */
+	uint16_t pad;
+};
+
+struct fimage {
+	void *base;
+	size_t size;
+	const struct fi_header *hdr;
+	const uint32_t *disp;
+	const uint32_t *slots;
+	const struct fi_user *users;
+	const struct fi_rule *rules;
+	const char *strings;
+};
+
+uint64_t fi_hash(const char *s);
+uint32_t fi_bucket(uint64_t h, uint32_t nbuckets);
+uint32_t fi_slot(uint64_t h, uint32_t disp, uint32_t nslots);
+
+struct fimage *fimage_open(const char *path, const char **errstr);
+void fimage_close(struct fimage *fi);
+const struct fi_user *fimage_user(const struct fimage *fi, const char *username);
+
+#define fimage_str(fi, off)	((fi)->strings + (off))
+
+#endif
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2013 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <mosquitto.h>
+#include "backends.h"
+#include "matcher.h"
+#include "uthash.h"
+
+#define MAXLEVELS	(64)		/* of a topic, on the stack */
+
+struct mnode {
+	char *level;			/* key in parent's children */
+	struct mnode *children;		/* literal levels */
+	struct mnode *plus;		/* '+' */
+	int access;			/* of filters ending here */
+	int hash_access;		/* of filters ending here with '/#' */
+	char *filter;
+	char *hash_filter;
+	UT_hash_handle hh;
+};
+
+struct mdynamic {
+	struct mdynamic *next;
+	char *filter;			/* with %c (and %u) */
+	int access;
+};
+
+struct matcher {
+	char *username;
+	struct mnode root;
+	struct mdynamic *dynamic;
+	int count;
+};
+
+struct matcher *matcher_new(const char *username)
+{
+	struct matcher *m;
+
+	if ((m = calloc(1, sizeof(struct matcher))) == NULL)
+		return (NULL);
+	if ((m->username = strdup(username ? username : "")) == NULL) {
+		free(m);
+		return (NULL);
+	}
+	return (m);
+}
+
+static void mnode_free(struct mnode *n)
+{
+	struct mnode *c, *tmp;
+
+	HASH_ITER(hh, n->children, c, tmp) {
+		HASH_DEL(n->children, c);
+		mnode_free(c);
+		free(c->level);
+		free(c);
+	}
+	if (n->plus) {
+		mnode_free(n->plus);
+		free(n->plus);
+	}
+	free(n->filter);
+	free(n->hash_filter);
+}
+
+void matcher_free(struct matcher *m)
+{
+	struct mdynamic *d, *next;
+
+	if (m == NULL)
+		return;
+	for (d = m->dynamic; d != NULL; d = next) {
+		next = d->next;
+		free(d->filter);
+		free(d);
+	}
+	mnode_free(&m->root);
+	free(m->username);
+	free(m);
+}
+
+int matcher_count(const struct matcher *m)
+{
+	return (m->count);
+}
+
+/*
+ * Add the rule `filter' with `access'. Returns 0, or -1 if out of memory.
+ */
+
+int matcher_add(struct matcher *m, const char *filter, int access)
+{
+	struct mnode *n = &m->root, *c;
+	char *expanded, *level, *s;
+
+	if (filter == NULL || *filter == 0)
+		return (0);
+
+	if (strstr(filter, "%c") != NULL) {
+		struct mdynamic *d = malloc(sizeof(struct mdynamic));
+
+		if (d == NULL || (d->filter = strdup(filter)) == NULL) {
+			free(d);
+			return (-1);
+		}
+		d->access = access;
+		d->next = m->dynamic;
+		m->dynamic = d;
+		m->count++;
+		return (0);
+	}
+
+	t_expand(NULL, m->username, filter, &expanded);
+	if (expanded == NULL)
+		return (-1);
+
+	for (s = expanded; ; ) {
+		level = s;
+		if ((s = strchr(s, '/')) != NULL)
+			*s = 0;
+
+		if (strcmp(level, "#") == 0) {
+			/* '#' is only valid last; ignore anything after it */
+			n->hash_access |= access;
+			if (n->hash_filter == NULL)
+				t_expand(NULL, m->username, filter, &n->hash_filter);
+			break;
+		}
+
+		if (strcmp(level, "+") == 0) {
+			if (n->plus == NULL && (n->plus = calloc(1, sizeof(struct mnode))) == NULL)
+				goto fail;
+			n = n->plus;
+		} else {
+			HASH_FIND_STR(n->children, level, c);
+			if (c == NULL) {
+				if ((c = calloc(1, sizeof(struct mnode))) == NULL ||
+				    (c->level = strdup(level)) == NULL) {
+					free(c);
+					goto fail;
+				}
+				HASH_ADD_KEYPTR(hh, n->children, c->level, strlen(c->level), c);
+			}
+			n = c;
+		}
+
+		if (s == NULL) {
+			n->access |= access;
+			if (n->filter == NULL)
+				t_expand(NULL, m->username, filter, &n->filter);
+			break;
+		}
+		s++;
+	}
+
+	free(expanded);
+	m->count++;
+	return (0);
+
+  fail:
+	free(expanded);
+	return (-1);
+}
+
+/*
+ * Find a filter in the subtree at `n' which matches levels i.. of the
+ * topic and grants `access'.
+ */
+
+static const char *walk(const struct mnode *n, char **levels, int nlevels, int i, int access)
+{
+	const struct mnode *c;
+	const char *found, *lv;
+	bool dollar = (i == 0 && levels[0][0] == '$');
+
+	/* "x/#" matches x and everything below it, "#" all but $-topics */
+	if ((n->hash_access & access) && !dollar)
+		return (n->hash_filter);
+
+	if (i == nlevels)
+		return ((n->access & access) ? n->filter : NULL);
+
+	lv = levels[i];
+	if (strcmp(lv, "#") == 0)
+		return (NULL);
+	if (strcmp(lv, "+") != 0) {
+		HASH_FIND_STR(n->children, lv, c);
+		if (c && (found = walk(c, levels, nlevels, i + 1, access)) != NULL)
+			return (found);
+	}
+	if (n->plus && !dollar)
+		return (walk(n->plus, levels, nlevels, i + 1, access));
+	return (NULL);
+}
+
+/*
+ * Does any rule grant `access' to `topic' (which may itself be a filter)?
+ * On a match, the matching filter is strdup()ed to `*rule' if not NULL.
+ */
+
+int matcher_match(const struct matcher *m, const char *clientid, const char *topic, int access, char **rule)
+{
+	char buf[512], *copy = buf, *lv[MAXLEVELS], **levels = lv, *s;
+	const struct mdynamic *d;
+	const char *found = NULL;
+	size_t len;
+	int nlevels = 1;
+	bool bf;
+
+	if (topic == NULL || *topic == 0)
+		return (false);
+
+	len = strlen(topic) + 1;
+	for (s = (char *)topic; (s = strchr(s, '/')) != NULL; s++)
+		nlevels++;
+	if (len > sizeof(buf) && (copy = malloc(len)) == NULL)
+		return (false);
+	if (nlevels > MAXLEVELS && (levels = malloc(nlevels * sizeof(char *))) == NULL) {
+		if (copy != buf)
+			free(copy);
+		return (false);
+	}
+	memcpy(copy, topic, len);
+	for (nlevels = 0, s = copy; ; s++) {
+		levels[nlevels++] = s;
+		if ((s = strchr(s, '/')) == NULL)
+			break;
+		*s = 0;
+	}
+
+	found = walk(&m->root, levels, nlevels, 0, access);
+
+	if (copy != buf)
+		free(copy);
+	if (levels != lv)
+		free(levels);
+
+	if (found) {
+		if (rule)
+			*rule = strdup(found);
+		return (true);
+	}
+
+	for (d = m->dynamic; d != NULL; d = d->next) {
+		char *expanded;
+
+		if ((d->access & access) == 0)
+			continue;
+		t_expand(clientid, m->username, d->filter, &expanded);
+		if (expanded == NULL)
+			continue;
+		if (t_matches(expanded, topic, &bf) == MOSQ_ERR_SUCCESS && bf) {
+			if (rule)
+				*rule = expanded;
+			else
+				free(expanded);
+			return (true);
+		}
+		free(expanded);
+	}
+	return (false);
+}
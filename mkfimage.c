@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2013 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * mkfimage: compile a files back-end password_file and acl_file into the
+ * read-only image described in files-image.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "files-image.h"
+#include "uthash.h"
+
+#define USAGE() fprintf(stderr, "Usage: %s [-p password_file] [-a acl_file] -o image\n", progname)
+
+struct rule {
+	struct rule *next;
+	struct fi_rule r;
+};
+
+struct user {
+	char *name;
+	uint32_t index;
+	uint32_t password;
+	struct rule *rules, **tail;
+	UT_hash_handle hh;
+};
+
+struct str {
+	char *s;
+	uint32_t off;
+	UT_hash_handle hh;
+};
+
+static struct user *users = NULL, **byindex = NULL;
+static uint32_t nusers = 0, nrules = 0;
+static struct rule *globals = NULL, **gtail = &globals;
+
+static struct str *strs = NULL;
+static char *strtab = NULL;
+static size_t strsize = 0, stralloc = 0;
+
+static void *xmalloc(size_t n)
+{
+	void *p;
+
+	if ((p = malloc(n)) == NULL) {
+		perror("malloc");
+		exit(2);
+	}
+	return (p);
+}
+
+/* Add `s' to the string table once, returning its offset. */
+static uint32_t intern(const char *s)
+{
+	struct str *e;
+	size_t len = strlen(s) + 1;
+
+	HASH_FIND_STR(strs, s, e);
+	if (e != NULL)
+		return (e->off);
+
+	while (strsize + len > stralloc) {
+		stralloc = stralloc ? stralloc * 2 : 65536;
+		if ((strtab = realloc(strtab, stralloc)) == NULL) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	e = xmalloc(sizeof(struct str));
+	e->s = strdup(s);
+	e->off = strsize;
+	memcpy(strtab + strsize, s, len);
+	strsize += len;
+	HASH_ADD_KEYPTR(hh, strs, e->s, strlen(e->s), e);
+	return (e->off);
+}
+
+static struct user *get_user(const char *name, int create)
+{
+	struct user *u;
+
+	HASH_FIND_STR(users, name, u);
+	if (u != NULL || !create)
+		return (u);
+
+	u = xmalloc(sizeof(struct user));
+	u->name = strdup(name);
+	u->index = nusers++;
+	u->password = FI_NONE;
+	u->rules = NULL;
+	u->tail = &u->rules;
+	HASH_ADD_KEYPTR(hh, users, u->name, strlen(u->name), u);
+	return (u);
+}
+
+static void chomp(char *s)
+{
+	char *p;
+
+	if ((p = strchr(s, '\r')) != NULL)
+		*p = '\0';
+	if ((p = strchr(s, '\n')) != NULL)
+		*p = '\0';
+}
+
+static void read_passwords(FILE *fp)
+{
+	char *line = NULL, *pos;
+	size_t linesize = 0;
+	struct user *u;
+
+	while (getline(&line, &linesize, fp) != -1) {
+		if (line[0] == '#' || line[0] == '\r' || line[0] == '\n')
+			continue;
+		if ((pos = strchr(line, ':')) == NULL)
+			continue;
+		*pos++ = '\0';
+		chomp(pos);
+		if ((u = get_user(line, 0)) != NULL && u->password != FI_NONE) {
+			fprintf(stderr, "duplicate user in password file: %s\n", line);
+			continue;
+		}
+		u = get_user(line, 1);
+		u->password = intern(pos);
+	}
+	free(line);
+}
+
+/*
+ * (read|write)?[ \t]+[^ \t]+, as in be-files.c
+ */
+static struct rule *acl_line(const char *line)
+{
+	struct rule *r = xmalloc(sizeof(struct rule));
+	const char *pos;
+	char *topic;
+	size_t len;
+
+	memset(r, 0, sizeof(struct rule));
+	if (strncmp("read", line, 4) == 0 && (line[4] == ' ' || line[4] == '\t')) {
+		r->r.access = FI_READ;
+		pos = &line[5];
+	} else if (strncmp("write", line, 5) == 0 && (line[5] == ' ' || line[5] == '\t')) {
+		r->r.access = FI_WRITE;
+		pos = &line[6];
+	} else {
+		r->r.access = FI_READ | FI_WRITE;
+		pos = &line[0];
+	}
+	for (; *pos == ' ' || *pos == '\t'; ++pos);
+	len = strcspn(pos, " \t\r\n");
+	topic = xmalloc(len + 1);
+	memcpy(topic, pos, len);
+	topic[len] = '\0';
+	r->r.topic = intern(topic);
+	r->r.flags = strchr(topic, '%') ? FI_EXPAND : 0;
+	free(topic);
+	nrules++;
+	return (r);
+}
+
+static void read_acl(FILE *fp)
+{
+	char *line = NULL, *pos;
+	size_t linesize = 0;
+	struct user *u = NULL;
+	struct rule *r;
+
+	while (getline(&line, &linesize, fp) != -1) {
+		if (line[0] == '#')
+			continue;
+		for (pos = line; *pos == ' ' || *pos == '\t'; ++pos);
+		if (*pos == '\r' || *pos == '\n' || *pos == '\0')
+			continue;
+		if (strncmp("user", pos, 4) == 0) {
+			for (pos += 4; *pos == ' ' || *pos == '\t'; ++pos);
+			chomp(pos);
+			u = get_user(pos, 1);
+		} else if (strncmp("topic", pos, 5) == 0) {
+			for (pos += 5; *pos == ' ' || *pos == '\t'; ++pos);
+			r = acl_line(pos);
+			if (u != NULL) {
+				*u->tail = r;
+				u->tail = &r->next;
+			} else {
+				*gtail = r;
+				gtail = &r->next;
+			}
+		} else if (strncmp("pattern", pos, 7) == 0) {
+			for (pos += 7; *pos == ' ' || *pos == '\t'; ++pos);
+			r = acl_line(pos);
+			*gtail = r;
+			gtail = &r->next;
+		} else {
+			fprintf(stderr, "failed to parse line: %s", line);
+		}
+	}
+	free(line);
+}
+
+/*
+ * Hash and displace: place the buckets largest first, each with the
+ * smallest displacement which puts all of its names into free slots.
+ */
+
+static uint32_t *sort_sizes;
+
+static int cmp_size(const void *a, const void *b)
+{
+	uint32_t sa = sort_sizes[*(uint32_t *)a], sb = sort_sizes[*(uint32_t *)b];
+
+	return (sa < sb) - (sa > sb);
+}
+
+#define MAXDISP	(1U << 24)
+
+static int build_phf(uint32_t nbuckets, uint32_t nslots, uint32_t *disp, uint32_t *slots)
+{
+	uint64_t *h = xmalloc((nusers + 1) * sizeof(uint64_t));
+	uint32_t *bsize = calloc(nbuckets, sizeof(uint32_t));
+	uint32_t *bstart = calloc(nbuckets + 1, sizeof(uint32_t));
+	uint32_t *members = xmalloc((nusers + 1) * sizeof(uint32_t));
+	uint32_t *order = xmalloc(nbuckets * sizeof(uint32_t));
+	uint32_t *fill = calloc(nbuckets, sizeof(uint32_t));
+	uint32_t want[64], i, j, b, d;
+	int ok = 1;
+
+	if (bsize == NULL || bstart == NULL || fill == NULL) {
+		perror("calloc");
+		exit(2);
+	}
+
+	for (i = 0; i < nusers; i++) {
+		h[i] = fi_hash(byindex[i]->name);
+		bsize[fi_bucket(h[i], nbuckets)]++;
+	}
+	for (b = 0; b < nbuckets; b++)
+		bstart[b + 1] = bstart[b] + bsize[b];
+	for (i = 0; i < nusers; i++) {
+		b = fi_bucket(h[i], nbuckets);
+		members[bstart[b] + fill[b]++] = i;
+	}
+	for (b = 0; b < nbuckets; b++)
+		order[b] = b;
+	sort_sizes = bsize;
+	qsort(order, nbuckets, sizeof(uint32_t), cmp_size);
+
+	for (i = 0; i < nslots; i++)
+		slots[i] = FI_NONE;
+	memset(disp, 0, nbuckets * sizeof(uint32_t));
+
+	for (j = 0; ok && j < nbuckets && bsize[order[j]] > 0; j++) {
+		b = order[j];
+		if (bsize[b] > sizeof(want) / sizeof(want[0])) {
+			ok = 0;
+			break;
+		}
+		for (d = 0; d < MAXDISP; d++) {
+			uint32_t k, m;
+
+			for (k = 0; k < bsize[b]; k++) {
+				want[k] = fi_slot(h[members[bstart[b] + k]], d, nslots);
+				if (slots[want[k]] != FI_NONE)
+					break;
+				for (m = 0; m < k && want[m] != want[k]; m++);
+				if (m < k)
+					break;
+			}
+			if (k == bsize[b])
+				break;
+		}
+		if (d == MAXDISP) {
+			ok = 0;
+			break;
+		}
+		disp[b] = d;
+		for (i = 0; i < bsize[b]; i++)
+			slots[want[i]] = members[bstart[b] + i];
+	}
+
+	free(h);
+	free(bsize);
+	free(bstart);
+	free(members);
+	free(order);
+	free(fill);
+	return (ok);
+}
+
+#define ALIGN8(x)	(((x) + 7) & ~(uint64_t)7)
+
+static int put(FILE *fp, uint64_t off, const void *p, size_t len)
+{
+	if (fseek(fp, off, SEEK_SET) != 0)
+		return (-1);
+	if (len > 0 && fwrite(p, len, 1, fp) != 1)
+		return (-1);
+	return (0);
+}
+
+int main(int argc, char **argv)
+{
+	char *progname = argv[0], *pwfile = NULL, *aclfile = NULL, *outfile = NULL, *tmpfile;
+	struct fi_header hdr;
+	struct fi_user *fu;
+	struct fi_rule *fr;
+	struct user *u, *tmp;
+	struct rule *r;
+	uint32_t *disp, *slots, n;
+	FILE *fp;
+	int c;
+
+	while ((c = getopt(argc, argv, "p:a:o:")) != EOF) {
+		switch (c) {
+			case 'p':
+				pwfile = optarg;
+				break;
+			case 'a':
+				aclfile = optarg;
+				break;
+			case 'o':
+				outfile = optarg;
+				break;
+			default:
+				exit(USAGE());
+		}
+	}
+	if (outfile == NULL || optind != argc) {
+		exit(USAGE());
+	}
+
+	/* offset 0 is the empty string */
+	intern("");
+
+	if (pwfile) {
+		if ((fp = fopen(pwfile, "r")) == NULL) {
+			perror(pwfile);
+			return (2);
+		}
+		read_passwords(fp);
+		fclose(fp);
+	}
+	if (aclfile) {
+		if ((fp = fopen(aclfile, "r")) == NULL) {
+			perror(aclfile);
+			return (2);
+		}
+		read_acl(fp);
+		fclose(fp);
+	}
+
+	byindex = xmalloc((nusers + 1) * sizeof(struct user *));
+	HASH_ITER(hh, users, u, tmp) {
+		byindex[u->index] = u;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = FI_MAGIC;
+	hdr.version = FI_VERSION;
+	hdr.nusers = nusers;
+	hdr.nrules = nrules;
+	hdr.acl_checks = aclfile != NULL;
+	hdr.nbuckets = nusers / 4 + 1;
+	hdr.nslots = nusers + nusers / 4 + 1;
+
+	disp = xmalloc(hdr.nbuckets * sizeof(uint32_t));
+	slots = xmalloc(hdr.nslots * sizeof(uint32_t));
+	while (!build_phf(hdr.nbuckets, hdr.nslots, disp, slots)) {
+		hdr.nslots += hdr.nslots / 4 + 1;
+		if ((slots = realloc(slots, hdr.nslots * sizeof(uint32_t))) == NULL) {
+			perror("realloc");
+			return (2);
+		}
+	}
+
+	/* Lay out each user's rules contiguously, then the global ones */
+	fu = xmalloc((nusers + 1) * sizeof(struct fi_user));
+	fr = xmalloc((nrules + 1) * sizeof(struct fi_rule));
+	for (n = 0, c = 0; n < nusers; n++) {
+		u = byindex[n];
+		fu[n].name = intern(u->name);
+		fu[n].password = u->password;
+		fu[n].rule_first = c;
+		for (r = u->rules; r; r = r->next)
+			fr[c++] = r->r;
+		fu[n].rule_count = c - fu[n].rule_first;
+	}
+	hdr.global_first = c;
+	for (r = globals; r; r = r->next)
+		fr[c++] = r->r;
+	hdr.global_count = c - hdr.global_first;
+
+	hdr.off_disp = ALIGN8(sizeof(hdr));
+	hdr.off_slots = ALIGN8(hdr.off_disp + hdr.nbuckets * sizeof(uint32_t));
+	hdr.off_users = ALIGN8(hdr.off_slots + hdr.nslots * sizeof(uint32_t));
+	hdr.off_rules = ALIGN8(hdr.off_users + nusers * sizeof(struct fi_user));
+	hdr.off_strings = ALIGN8(hdr.off_rules + nrules * sizeof(struct fi_rule));
+	hdr.strings_size = strsize;
+	hdr.size = hdr.off_strings + strsize;
+
+	/* Write aside and rename, so that a running broker never maps half an image */
+	tmpfile = xmalloc(strlen(outfile) + 5);
+	sprintf(tmpfile, "%s.tmp", outfile);
+	if ((fp = fopen(tmpfile, "w")) == NULL) {
+		perror(tmpfile);
+		return (2);
+	}
+	if (put(fp, 0, &hdr, sizeof(hdr)) != 0 ||
+	    put(fp, hdr.off_disp, disp, hdr.nbuckets * sizeof(uint32_t)) != 0 ||
+	    put(fp, hdr.off_slots, slots, hdr.nslots * sizeof(uint32_t)) != 0 ||
+	    put(fp, hdr.off_users, fu, nusers * sizeof(struct fi_user)) != 0 ||
+	    put(fp, hdr.off_rules, fr, nrules * sizeof(struct fi_rule)) != 0 ||
+	    put(fp, hdr.off_strings, strtab, strsize) != 0) {
+		perror(tmpfile);
+		fclose(fp);
+		unlink(tmpfile);
+		return (2);
+	}
+	if (fclose(fp) != 0 || rename(tmpfile, outfile) != 0) {
+		perror(outfile);
+		unlink(tmpfile);
+		return (2);
+	}
+
+	printf("%u users, %u rules, %zu bytes of strings, %u slots\n",
+		nusers, nrules, strsize, hdr.nslots);
+	return (0);
+}
@@ -32,15 +32,228 @@
 #include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
 #include "base64.h"
+#include "pbkdf2-mb.h"
 
 #define KEY_LENGTH      24
 #define SEPARATOR       "$"
 #define SALTLEN 12
 
-#define USAGE() fprintf(stderr, "Usage: %s [-i iterations] [-p password]\n", progname)
+/*
+ * HMACSHA256$ hashes skip key stretching, so they are only safe for
+ * passwords with plenty of entropy, such as random device tokens.
+ */
+#define HMAC_MINPWLEN	32
+
+#define USAGE() fprintf(stderr, "Usage: %s [-a pbkdf2|hmac-sha256] [-i iterations] [-p password]\n" \
+			"       %s -b [-a pbkdf2|hmac-sha256] [-i iterations] [-t threads] [-f file]\n", progname, progname)
+
+/*
+ * Bulk mode reads username:password lines from a file or stdin and writes
+ * username:hash lines in the same order. Lines are processed in chunks;
+ * each chunk's salts come from a single RAND_bytes() call and its hashes
+ * are computed by `nthreads' workers, each one running its share through
+ * the multi-buffer PBKDF2 code.
+ */
+
+#define CHUNKPERTHREAD	(256)
+
+struct record {
+	char *line;			/* username, NUL, password */
+	char *password;
+	unsigned char saltbytes[SALTLEN];
+	char salt[SALTLEN * 2];		/* base64 */
+	unsigned char key[EVP_MAX_MD_SIZE];
+	unsigned int keylen;
+	struct pbkdf2_job job;
+};
+
+struct worker {
+	pthread_t tid;
+	struct record *recs;
+	int nrecs;
+	int iterations;
+	int hmac;
+};
+
+static void set_salt(struct record *r, const unsigned char *saltbytes)
+{
+	char *salt;
+
+	memcpy(r->saltbytes, saltbytes, SALTLEN);
+	base64_encode(saltbytes, SALTLEN, &salt);
+	snprintf(r->salt, sizeof(r->salt), "%s", salt);
+	free(salt);
+}
+
+static void *bulk_worker(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct pbkdf2_job **jobs;
+	int i;
+
+	if (w->hmac) {
+		for (i = 0; i < w->nrecs; i++) {
+			struct record *r = &w->recs[i];
+
+#ifdef RAW_SALT
+			HMAC(EVP_sha256(), r->saltbytes, SALTLEN,
+#else
+			HMAC(EVP_sha256(), r->salt, strlen(r->salt),
+#endif
+				(unsigned char *)r->password, strlen(r->password),
+				r->key, &r->keylen);
+		}
+		return (NULL);
+	}
+
+	if ((jobs = malloc(w->nrecs * sizeof(struct pbkdf2_job *))) == NULL)
+		return (NULL);
+	for (i = 0; i < w->nrecs; i++) {
+		struct record *r = &w->recs[i];
+		struct pbkdf2_job *job = &r->job;
+
+		job->password = r->password;
+		job->pwlen = strlen(r->password);
+#ifdef RAW_SALT
+		job->salt = r->saltbytes;
+		job->saltlen = SALTLEN;
+#else
+		job->salt = (unsigned char *)r->salt;
+		job->saltlen = strlen(r->salt);
+#endif
+		job->iterations = w->iterations;
+		job->md = EVP_sha256();
+		job->out = r->key;
+		job->keylen = r->keylen = KEY_LENGTH;
+		jobs[i] = job;
+	}
+	pbkdf2_mb_run(jobs, w->nrecs);
+	free(jobs);
+	return (NULL);
+}
+
+/*
+ * Hash `nrecs' records with `nthreads' workers and print them in order.
+ */
+
+static int bulk_chunk(struct record *recs, int nrecs, unsigned char *saltbuf, int nthreads, int iterations, int hmac)
+{
+	struct worker *w;
+	int i, n, per, rc = 0;
+	char *b64;
+
+	if (RAND_bytes(saltbuf, nrecs * SALTLEN) != 1) {
+		fprintf(stderr, "Cannot get random bytes for salt!\n");
+		return (-1);
+	}
+	for (i = 0; i < nrecs; i++) {
+		set_salt(&recs[i], saltbuf + i * SALTLEN);
+	}
+
+	if ((w = calloc(nthreads, sizeof(struct worker))) == NULL)
+		return (-1);
+	per = (nrecs + nthreads - 1) / nthreads;
+	for (i = 0, n = 0; i < nthreads && n < nrecs; i++, n += per) {
+		w[i].recs = recs + n;
+		w[i].nrecs = (nrecs - n < per) ? nrecs - n : per;
+		w[i].iterations = iterations;
+		w[i].hmac = hmac;
+		if (pthread_create(&w[i].tid, NULL, bulk_worker, &w[i]) != 0) {
+			bulk_worker(&w[i]);
+			w[i].nrecs = 0;
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (w[i].nrecs > 0)
+			pthread_join(w[i].tid, NULL);
+	}
+	free(w);
+
+	for (i = 0; i < nrecs; i++) {
+		struct record *r = &recs[i];
+
+		if (r->keylen == 0 || (!hmac && r->job.rc != 1)) {
+			fprintf(stderr, "Cannot hash password for %s\n", r->line);
+			rc = -1;
+		} else if (base64_encode(r->key, r->keylen, &b64) > 0) {
+			if (hmac) {
+				printf("%s:HMACSHA256$%s$%s\n", r->line, r->salt, b64);
+			} else {
+				printf("%s:PBKDF2$%s$%d$%s$%s\n", r->line, "sha256",
+					iterations, r->salt, b64);
+			}
+			free(b64);
+		}
+		OPENSSL_cleanse(r->key, sizeof(r->key));
+		OPENSSL_cleanse(r->password, strlen(r->password));
+		free(r->line);
+	}
+	return (rc);
+}
+
+static int bulk(FILE *fp, int nthreads, int iterations, int hmac)
+{
+	struct record *recs;
+	unsigned char *saltbuf;
+	int chunk = nthreads * CHUNKPERTHREAD, nrecs = 0, lineno = 0, rc = 0;
+	char *line = NULL, *p;
+	size_t linesize = 0;
+	ssize_t len;
+
+	if ((recs = calloc(chunk, sizeof(struct record))) == NULL)
+		return (1);
+	if ((saltbuf = malloc(chunk * SALTLEN)) == NULL) {
+		free(recs);
+		return (1);
+	}
+
+	while ((len = getline(&line, &linesize, fp)) != -1) {
+		lineno++;
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+		if (len == 0 || *line == '#')
+			continue;
+		if ((p = strchr(line, ':')) == NULL || p == line) {
+			fprintf(stderr, "Line %d: expecting username:password\n", lineno);
+			rc = 1;
+			continue;
+		}
+
+		memset(&recs[nrecs], 0, sizeof(struct record));
+		if ((recs[nrecs].line = strdup(line)) == NULL) {
+			rc = 1;
+			break;
+		}
+		recs[nrecs].password = recs[nrecs].line + (p - line) + 1;
+		recs[nrecs].password[-1] = 0;
+		if (hmac && strlen(recs[nrecs].password) < HMAC_MINPWLEN) {
+			fprintf(stderr, "Warning: line %d: hmac-sha256 is only meant for random tokens of at least %d characters\n",
+				lineno, HMAC_MINPWLEN);
+		}
+
+		if (++nrecs == chunk) {
+			if (bulk_chunk(recs, nrecs, saltbuf, nthreads, iterations, hmac) != 0)
+				rc = 1;
+			nrecs = 0;
+		}
+	}
+	if (nrecs > 0 && bulk_chunk(recs, nrecs, saltbuf, nthreads, iterations, hmac) != 0)
+		rc = 1;
+
+	if (line) {
+		OPENSSL_cleanse(line, linesize);
+		free(line);
+	}
+	free(saltbuf);
+	free(recs);
+	return (rc);
+}
 
 int main(int argc, char **argv)
 {
@@ -48,15 +261,34 @@ int main(int argc, char **argv)
 	unsigned char	saltbytes[SALTLEN];
 	char *salt, *b64;
 	unsigned char key[128];
-	char *pw1, *pw2, *password;
+	char *pw1 = NULL, *pw2 = NULL, *password;
 	char *progname = argv[0];
 	int c;
 	int prompt;
+	int hmac = 0;
+	int bulkmode = 0, nthreads = 0;
+	char *infile = NULL;
 
 	prompt = 1;
 
-	while ((c = getopt(argc, argv, "i:p:")) != EOF) {
+	while ((c = getopt(argc, argv, "a:bf:i:p:t:")) != EOF) {
 		switch (c) {
+			case 'b':
+				bulkmode = 1;
+				break;
+			case 'f':
+				infile = optarg;
+				break;
+			case 't':
+				nthreads = atoi(optarg);
+				break;
+			case 'a':
+				if (strcmp(optarg, "hmac-sha256") == 0) {
+					hmac = 1;
+				} else if (strcmp(optarg, "pbkdf2") != 0) {
+					exit(USAGE());
+				}
+				break;
 			case 'i':
 				iterations = atoi(optarg);
 				break;
@@ -77,6 +309,21 @@ int main(int argc, char **argv)
 		exit(USAGE());
 	}
 
+	if (bulkmode) {
+		FILE *fp = stdin;
+
+		if (nthreads < 1 && (nthreads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			nthreads = 1;
+		if (infile && (fp = fopen(infile, "r")) == NULL) {
+			perror(infile);
+			return (2);
+		}
+		rc = bulk(fp, nthreads, iterations, hmac);
+		if (fp != stdin)
+			fclose(fp);
+		return (rc);
+	}
+
 	if ( prompt ) {
 		pw1 = strdup(getpass("Enter password: "));
 		pw2 = getpass("Re-enter same password: ");
@@ -97,6 +344,29 @@ int main(int argc, char **argv)
 
 	base64_encode(saltbytes, SALTLEN, &salt);
 
+	if (hmac) {
+		unsigned int keylen;
+
+		if (strlen(password) < HMAC_MINPWLEN) {
+			fprintf(stderr, "Warning: hmac-sha256 is only meant for random tokens of at least %d characters\n",
+				HMAC_MINPWLEN);
+		}
+#ifdef RAW_SALT
+		HMAC(EVP_sha256(), saltbytes, SALTLEN,
+			(unsigned char *)password, strlen(password), key, &keylen);
+#else
+		HMAC(EVP_sha256(), salt, strlen(salt),
+			(unsigned char *)password, strlen(password), key, &keylen);
+#endif
+		blen = base64_encode(key, keylen, &b64);
+		if (blen > 0) {
+			printf("HMACSHA256$%s$%s\n", salt, b64);
+			free(b64);
+		}
+		free(password);
+		return 0;
+	}
+
 #ifdef RAW_SALT
 	PKCS5_PBKDF2_HMAC(password, strlen(password),
 		(unsigned char *)saltbytes, SALTLEN,
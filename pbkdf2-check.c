@@ -31,167 +31,221 @@
 #include <stdlib.h>
 #include <string.h>
 #include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
 #include "base64.h"
+#include "uthash.h"
 
 #define SEPARATOR       "$"
 #define TRUE	(1)
 #define FALSE	(0)
 
-
-/*
- * Split PBKDF2$... string into their components. The caller must free()
- * the strings.
- */
-
-static int detoken(char *pbkstr, char **sha, int *iter, char **salt, char **key)
-{
-	char *p, *s, *save;
-	int rc = 1;
-
-	save = s = strdup(pbkstr);
-
 #if defined(SUPPORT_DJANGO_HASHERS)
-{
-	if ((p = strsep(&s, "_")) == NULL)
-		goto out;
-	if (strcmp(p, "pbkdf2") != 0)
-		goto out;
-}
+# define PREFIX		"pbkdf2_"
 #else
-{
-	if ((p = strsep(&s, SEPARATOR)) == NULL)
-		goto out;
-	if (strcmp(p, "PBKDF2") != 0)
-		goto out;
-}
+# define PREFIX		"PBKDF2" SEPARATOR
 #endif
 
-	if ((p = strsep(&s, SEPARATOR)) == NULL)
-		goto out;
-	*sha = strdup(p);
-
-	if ((p = strsep(&s, SEPARATOR)) == NULL)
-		goto out;
-	*iter = atoi(p);
+/*
+ * HMACSHA256$<salt>$<digest> is a single HMAC-SHA256 of the password keyed
+ * with the salt. It is meant for machine-generated credentials with enough
+ * entropy (e.g. 256-bit random tokens) that key stretching adds nothing.
+ */
+#define HMAC_PREFIX	"HMACSHA256" SEPARATOR
 
-	if ((p = strsep(&s, SEPARATOR)) == NULL)
-		goto out;
-	*salt = strdup(p);
+#define MAXKEYLEN	(512)		/* bytes of derived key */
+#define MAXPARSED	(65536)		/* parsed hashes kept */
 
-	if ((p = strsep(&s, SEPARATOR)) == NULL)
-		goto out;
-	*key = strdup(p);
+/*
+ * Parsed form of a stored PBKDF2$... or HMACSHA256$... string, keyed by that
+ * string, so that repeated logins don't tokenize and base64-decode it again.
+ * `iterations' is 0 for the HMAC form.
+ */
 
-	rc = 0;
+struct pbkdf2_hash {
+	char *hash;			/* key */
+	const EVP_MD *md;
+	int iterations;
+	unsigned char *salt;
+	int saltlen;
+	unsigned char *key;
+	int keylen;
+	UT_hash_handle hh;
+};
 
-     out:
-	free(save);
-	return rc;
-}
+static struct pbkdf2_hash *parsed = NULL;
 
-int pbkdf2_check(char *password, char *hash)
+static void hash_free(struct pbkdf2_hash *ph)
 {
-	char *sha, *salt, *h_pw;
-	int iterations, saltlen, blen;
-	char *b64, *keybuf;
-	unsigned char *out;
-	int match = FALSE;
-	const EVP_MD *evpmd;
-	int keylen, rc;
+	free(ph->hash);
+	free(ph->salt);
+	if (ph->key) {
+		OPENSSL_cleanse(ph->key, ph->keylen);
+		free(ph->key);
+	}
+	free(ph);
+}
 
-	if (detoken(hash, &sha, &iterations, &salt, &h_pw) != 0)
-		return match;
+/*
+ * Split PBKDF2$<digest>$<iterations>$<salt>$<key> or HMACSHA256$<salt>$<key>
+ * into its components and decode them. Returns NULL if the string isn't in
+ * either format.
+ */
 
-	/* Determine key length by decoding base64 */
-	if ((keybuf = malloc(strlen(h_pw) + 1)) == NULL) {
-		fprintf(stderr, "Out of memory\n");
-		return FALSE;
-	}
-	keylen = base64_decode(h_pw, keybuf);
-	if (keylen < 1) {
-		free(keybuf);
-		return (FALSE);
+static struct pbkdf2_hash *detoken(const char *pbkstr)
+{
+	struct pbkdf2_hash *ph;
+	char *work, *s, *sha, *iter, *salt, *key;
+	int hmac;
+
+	if (strncmp(pbkstr, PREFIX, strlen(PREFIX)) == 0) {
+		hmac = FALSE;
+	} else if (strncmp(pbkstr, HMAC_PREFIX, strlen(HMAC_PREFIX)) == 0) {
+		hmac = TRUE;
+	} else {
+		return (NULL);
 	}
-	free(keybuf);
 
-	if ((out = malloc(keylen)) == NULL) {
-		fprintf(stderr, "Cannot allocate out; out of memory\n");
-		return (FALSE);
+	if ((ph = calloc(1, sizeof(struct pbkdf2_hash))) == NULL)
+		return (NULL);
+	if ((work = s = strdup(pbkstr + strlen(hmac ? HMAC_PREFIX : PREFIX))) == NULL) {
+		free(ph);
+		return (NULL);
 	}
 
-#ifdef RAW_SALT
-	char *rawSalt;
-
-	if ((rawSalt = malloc(strlen(salt) + 1)) == NULL) {
-		fprintf(stderr, "Out of memory\n");
-		return FALSE;
+	if (hmac) {
+		sha = "sha256";
+		iter = "0";
+	} else if ((sha = strsep(&s, SEPARATOR)) == NULL ||
+	    (iter = strsep(&s, SEPARATOR)) == NULL) {
+		goto fail;
 	}
+	if ((salt = strsep(&s, SEPARATOR)) == NULL ||
+	    (key = strsep(&s, SEPARATOR)) == NULL)
+		goto fail;
 
-	saltlen = base64_decode(salt, rawSalt);
-	if (saltlen < 1) {
-		return (FALSE);
+	ph->md = EVP_sha256();
+	if (strcmp(sha, "sha1") == 0) {
+		ph->md = EVP_sha1();
+	} else if (strcmp(sha, "sha512") == 0) {
+		ph->md = EVP_sha512();
 	}
+	ph->iterations = atoi(iter);
+	if (!hmac && ph->iterations < 1)
+		goto fail;
 
-	free(salt);
-	salt = rawSalt;
-	rawSalt = NULL;
+#ifdef RAW_SALT
+	if ((ph->salt = malloc(strlen(salt) + 1)) == NULL)
+		goto fail;
+	ph->saltlen = base64_decode(salt, ph->salt);
+	if (ph->saltlen < 1)
+		goto fail;
 #else
-	saltlen = strlen((char *)salt);
+	ph->saltlen = strlen(salt);
+	if ((ph->salt = (unsigned char *)strdup(salt)) == NULL)
+		goto fail;
 #endif
 
+	if ((ph->key = malloc(strlen(key) + 1)) == NULL)
+		goto fail;
+	ph->keylen = base64_decode(key, ph->key);
+	if (ph->keylen < 1 || ph->keylen > MAXKEYLEN)
+		goto fail;
+
+	if ((ph->hash = strdup(pbkstr)) == NULL)
+		goto fail;
+
 #ifdef PWDEBUG
 	fprintf(stderr, "sha        =[%s]\n", sha);
-	fprintf(stderr, "iterations =%d\n", iterations);
+	fprintf(stderr, "iterations =%d\n", ph->iterations);
 	fprintf(stderr, "salt       =[%s]\n", salt);
-	fprintf(stderr, "salt len   =[%d]\n", saltlen);
-	fprintf(stderr, "h_pw       =[%s]\n", h_pw);
-	fprintf(stderr, "kenlen     =[%d]\n", keylen);
+	fprintf(stderr, "salt len   =[%d]\n", ph->saltlen);
+	fprintf(stderr, "h_pw       =[%s]\n", key);
+	fprintf(stderr, "kenlen     =[%d]\n", ph->keylen);
 #endif
 
+	free(work);
+	return (ph);
 
-	evpmd = EVP_sha256();
-	if (strcmp(sha, "sha1") == 0) {
-		evpmd = EVP_sha1();
-	} else if (strcmp(sha, "sha512") == 0) {
-		evpmd = EVP_sha512();
-	}
+  fail:
+	free(work);
+	hash_free(ph);
+	return (NULL);
+}
 
-	rc = PKCS5_PBKDF2_HMAC(password, strlen(password),
-		(unsigned char *)salt, saltlen,
-		iterations,
-		evpmd, keylen, out);
-	if (rc != 1) {
-		goto out;
-	}
+/*
+ * Find the parsed form of `hash' (`hashlen' bytes, not necessarily NUL
+ * terminated), parsing and remembering it on first use.
+ * The oldest entry is dropped once MAXPARSED hashes are held.
+ */
 
-	blen = base64_encode(out, keylen, &b64);
-	if (blen > 0) {
-		int i, diff = 0, hlen = strlen(h_pw);
-#ifdef PWDEBUG
-		fprintf(stderr, "HMAC b64   =[%s]\n", b64);
-#endif
+static struct pbkdf2_hash *lookup(const char *hash, size_t hashlen)
+{
+	struct pbkdf2_hash *ph;
+	char *copy;
 
-		/* "manual" strcmp() to ensure constant time */
-		for (i = 0; (i < blen) && (i < hlen); i++) {
-			diff |= h_pw[i] ^ b64[i];
-		}
+	HASH_FIND(hh, parsed, hash, hashlen, ph);
+	if (ph != NULL)
+		return (ph);
 
-		match = diff == 0;
-		if (hlen != blen)
-			match = 0;
+	if ((copy = strndup(hash, hashlen)) == NULL)
+		return (NULL);
+	ph = detoken(copy);
+	free(copy);
+	if (ph == NULL)
+		return (NULL);
 
-		free(b64);
+	if (HASH_COUNT(parsed) >= MAXPARSED) {
+		struct pbkdf2_hash *oldest = parsed;
+
+		HASH_DEL(parsed, oldest);
+		hash_free(oldest);
 	}
+	HASH_ADD_KEYPTR(hh, parsed, ph->hash, strlen(ph->hash), ph);
+	return (ph);
+}
 
-  out:
-	free(sha);
-	free(salt);
-	free(h_pw);
-	free(out);
+/*
+ * Check `password' against a stored hash of `hashlen' bytes, which need
+ * not be NUL terminated, so back-ends can lend one in place, e.g. within
+ * a mapped file.
+ */
+
+int pbkdf2_check_len(const char *password, const char *hash, size_t hashlen)
+{
+	struct pbkdf2_hash *ph;
+	unsigned char out[MAXKEYLEN];
+	unsigned int outlen;
+	int match = FALSE;
+
+	if ((ph = lookup(hash, hashlen)) == NULL)
+		return (FALSE);
+
+	if (ph->iterations == 0) {
+		if (HMAC(ph->md, ph->salt, ph->saltlen,
+			(unsigned char *)password, strlen(password),
+			out, &outlen) != NULL && outlen == (unsigned int)ph->keylen) {
+
+			match = CRYPTO_memcmp(out, ph->key, ph->keylen) == 0;
+		}
+	} else if (PKCS5_PBKDF2_HMAC(password, strlen(password),
+		ph->salt, ph->saltlen,
+		ph->iterations,
+		ph->md, ph->keylen, out) == 1) {
+
+		/* constant time on the raw derived key */
+		match = CRYPTO_memcmp(out, ph->key, ph->keylen) == 0;
+	}
+	OPENSSL_cleanse(out, ph->keylen);
 
 	return match;
 }
 
+int pbkdf2_check(char *password, char *hash)
+{
+	return pbkdf2_check_len(password, hash, strlen(hash));
+}
+
 #if TEST
 int main()
 {
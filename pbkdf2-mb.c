@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) 2013 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+#include "pbkdf2-mb.h"
+
+/*
+ * Lane counts follow the widest vector unit the compiler was told about
+ * (e.g. CFG_CFLAGS = -mavx2 or -march=native); without any, GCC lowers
+ * the vector types to SSE2 or scalar code.
+ */
+
+#if defined(__AVX512F__)
+# define VECBYTES	(64)
+#elif defined(__AVX2__)
+# define VECBYTES	(32)
+#else
+# define VECBYTES	(16)
+#endif
+
+#define L256	(VECBYTES / 4)
+#define L512	(VECBYTES / 8)
+#define MAXLANES	L256
+
+#ifdef __GNUC__
+# define MB_VECTORS
+#endif
+
+#ifdef MB_VECTORS
+
+typedef uint32_t v32 __attribute__((vector_size(VECBYTES)));
+typedef uint64_t v64 __attribute__((vector_size(VECBYTES)));
+
+static const uint32_t K256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t IV256[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint64_t K512[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+static const uint64_t IV512[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define ROR64(x, n)	(((x) >> (n)) | ((x) << (64 - (n))))
+
+static inline void sha256_mb_compress(v32 *st, const v32 *blk)
+{
+	v32 w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int t;
+
+	for (t = 0; t < 16; t++)
+		w[t] = blk[t];
+	for (t = 16; t < 64; t++) {
+		w[t] = (ROR32(w[t - 2], 17) ^ ROR32(w[t - 2], 19) ^ (w[t - 2] >> 10)) + w[t - 7] +
+		       (ROR32(w[t - 15], 7) ^ ROR32(w[t - 15], 18) ^ (w[t - 15] >> 3)) + w[t - 16];
+	}
+
+	a = st[0]; b = st[1]; c = st[2]; d = st[3];
+	e = st[4]; f = st[5]; g = st[6]; h = st[7];
+	for (t = 0; t < 64; t++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + K256[t] + w[t];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+	st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+}
+
+static inline void sha512_mb_compress(v64 *st, const v64 *blk)
+{
+	v64 w[80], a, b, c, d, e, f, g, h, t1, t2;
+	int t;
+
+	for (t = 0; t < 16; t++)
+		w[t] = blk[t];
+	for (t = 16; t < 80; t++) {
+		w[t] = (ROR64(w[t - 2], 19) ^ ROR64(w[t - 2], 61) ^ (w[t - 2] >> 6)) + w[t - 7] +
+		       (ROR64(w[t - 15], 1) ^ ROR64(w[t - 15], 8) ^ (w[t - 15] >> 7)) + w[t - 16];
+	}
+
+	a = st[0]; b = st[1]; c = st[2]; d = st[3];
+	e = st[4]; f = st[5]; g = st[6]; h = st[7];
+	for (t = 0; t < 80; t++) {
+		t1 = h + (ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41)) + ((e & f) ^ (~e & g)) + K512[t] + w[t];
+		t2 = (ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+	st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+}
+
+/*
+ * Transpose between per-lane big-endian byte strings and vectors of words.
+ */
+
+static void load32(v32 *v, int nwords, const unsigned char *bytes, int stride, int n)
+{
+	int i, lane;
+
+	for (i = 0; i < nwords; i++) {
+		for (lane = 0; lane < L256; lane++) {
+			const unsigned char *p = bytes + (lane < n ? lane : 0) * stride + i * 4;
+
+			v[i][lane] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+				     ((uint32_t)p[2] << 8) | p[3];
+		}
+	}
+}
+
+static void store32(unsigned char *bytes, int stride, int n, const v32 *v, int nwords)
+{
+	int i, lane;
+
+	for (lane = 0; lane < n; lane++) {
+		for (i = 0; i < nwords; i++) {
+			unsigned char *p = bytes + lane * stride + i * 4;
+
+			p[0] = v[i][lane] >> 24; p[1] = v[i][lane] >> 16;
+			p[2] = v[i][lane] >> 8; p[3] = v[i][lane];
+		}
+	}
+}
+
+static void load64(v64 *v, int nwords, const unsigned char *bytes, int stride, int n)
+{
+	int i, lane, k;
+
+	for (i = 0; i < nwords; i++) {
+		for (lane = 0; lane < L512; lane++) {
+			const unsigned char *p = bytes + (lane < n ? lane : 0) * stride + i * 8;
+			uint64_t w = 0;
+
+			for (k = 0; k < 8; k++)
+				w = (w << 8) | p[k];
+			v[i][lane] = w;
+		}
+	}
+}
+
+static void store64(unsigned char *bytes, int stride, int n, const v64 *v, int nwords)
+{
+	int i, lane, k;
+
+	for (lane = 0; lane < n; lane++) {
+		for (i = 0; i < nwords; i++) {
+			unsigned char *p = bytes + lane * stride + i * 8;
+
+			for (k = 0; k < 8; k++)
+				p[k] = v[i][lane] >> (56 - 8 * k);
+		}
+	}
+}
+
+/*
+ * Run `count' further PBKDF2 iterations on n <= L256 chains. `ipad'/`opad'
+ * hold each chain's HMAC key block XORed with 0x36/0x5c, `u' holds U1 on
+ * entry and the chain's output block T on return.
+ */
+
+static void sha256_mb_iterate(int n, const unsigned char *ipad, const unsigned char *opad, unsigned char *u, int count)
+{
+	v32 istate[8], ostate[8], s[8], t[8], blk[16];
+	int i, j;
+
+	for (i = 0; i < 8; i++)
+		istate[i] = ostate[i] = (v32){ 0 } + IV256[i];
+	load32(blk, 16, ipad, 64, n);
+	sha256_mb_compress(istate, blk);
+	load32(blk, 16, opad, 64, n);
+	sha256_mb_compress(ostate, blk);
+
+	/* One-block messages: 32 bytes of data after a 64-byte key block */
+	load32(blk, 8, u, 32, n);
+	for (i = 0; i < 8; i++)
+		t[i] = blk[i];
+	blk[8] = (v32){ 0 } + 0x80000000;
+	for (i = 9; i < 15; i++)
+		blk[i] = (v32){ 0 };
+	blk[15] = (v32){ 0 } + (64 + 32) * 8;
+
+	for (j = 0; j < count; j++) {
+		for (i = 0; i < 8; i++)
+			s[i] = istate[i];
+		sha256_mb_compress(s, blk);
+		for (i = 0; i < 8; i++)
+			blk[i] = s[i];
+		for (i = 0; i < 8; i++)
+			s[i] = ostate[i];
+		sha256_mb_compress(s, blk);
+		for (i = 0; i < 8; i++) {
+			blk[i] = s[i];
+			t[i] ^= s[i];
+		}
+	}
+	store32(u, 32, n, t, 8);
+}
+
+static void sha512_mb_iterate(int n, const unsigned char *ipad, const unsigned char *opad, unsigned char *u, int count)
+{
+	v64 istate[8], ostate[8], s[8], t[8], blk[16];
+	int i, j;
+
+	for (i = 0; i < 8; i++)
+		istate[i] = ostate[i] = (v64){ 0 } + IV512[i];
+	load64(blk, 16, ipad, 128, n);
+	sha512_mb_compress(istate, blk);
+	load64(blk, 16, opad, 128, n);
+	sha512_mb_compress(ostate, blk);
+
+	/* One-block messages: 64 bytes of data after a 128-byte key block */
+	load64(blk, 8, u, 64, n);
+	for (i = 0; i < 8; i++)
+		t[i] = blk[i];
+	blk[8] = (v64){ 0 } + 0x8000000000000000ULL;
+	for (i = 9; i < 15; i++)
+		blk[i] = (v64){ 0 };
+	blk[15] = (v64){ 0 } + (128 + 64) * 8;
+
+	for (j = 0; j < count; j++) {
+		for (i = 0; i < 8; i++)
+			s[i] = istate[i];
+		sha512_mb_compress(s, blk);
+		for (i = 0; i < 8; i++)
+			blk[i] = s[i];
+		for (i = 0; i < 8; i++)
+			s[i] = ostate[i];
+		sha512_mb_compress(s, blk);
+		for (i = 0; i < 8; i++) {
+			blk[i] = s[i];
+			t[i] ^= s[i];
+		}
+	}
+	store64(u, 64, n, t, 8);
+}
+
+#endif /* MB_VECTORS */
+
+/*
+ * One output block of one job: T_i = U_1 ^ ... ^ U_c for block index i.
+ */
+
+struct chain {
+	struct pbkdf2_job *job;
+	unsigned int block;
+	int done;
+};
+
+static void openssl_run(struct pbkdf2_job *job)
+{
+	job->rc = PKCS5_PBKDF2_HMAC(job->password, job->pwlen,
+		job->salt, job->saltlen, job->iterations,
+		job->md, job->keylen, job->out);
+}
+
+int pbkdf2_mb_lanes(const EVP_MD *md)
+{
+#ifdef MB_VECTORS
+	if (EVP_MD_type(md) == EVP_MD_type(EVP_sha256()))
+		return (L256);
+	if (EVP_MD_type(md) == EVP_MD_type(EVP_sha512()))
+		return (L512);
+#endif
+	return (1);
+}
+
+#ifdef MB_VECTORS
+/*
+ * Compute up to `lanes' chains of the same digest and iteration count.
+ */
+
+static void run_lanes(struct chain **c, int n)
+{
+	const EVP_MD *md = c[0]->job->md;
+	int bsize = EVP_MD_block_size(md), hlen = EVP_MD_size(md);
+	unsigned char ipad[MAXLANES * 128], opad[MAXLANES * 128], u[MAXLANES * 64];
+	unsigned char *msg;
+	int i, k;
+
+	for (i = 0; i < n; i++) {
+		struct pbkdf2_job *job = c[i]->job;
+		unsigned char *ip = ipad + i * bsize, *op = opad + i * bsize;
+		unsigned int keylen = hlen;
+
+		/* HMAC key block: the password, hashed first if too long */
+		memset(ip, 0, bsize);
+		if (job->pwlen > (size_t)bsize) {
+			EVP_Digest(job->password, job->pwlen, ip, &keylen, md, NULL);
+		} else {
+			memcpy(ip, job->password, job->pwlen);
+		}
+		for (k = 0; k < bsize; k++) {
+			op[k] = ip[k] ^ 0x5c;
+			ip[k] ^= 0x36;
+		}
+
+		/* U_1 = HMAC(P, S || INT(i)) */
+		if ((msg = malloc(job->saltlen + 4)) == NULL) {
+			job->rc = 0;
+			continue;
+		}
+		memcpy(msg, job->salt, job->saltlen);
+		msg[job->saltlen + 0] = (c[i]->block + 1) >> 24;
+		msg[job->saltlen + 1] = (c[i]->block + 1) >> 16;
+		msg[job->saltlen + 2] = (c[i]->block + 1) >> 8;
+		msg[job->saltlen + 3] = (c[i]->block + 1);
+		if (HMAC(md, job->password, job->pwlen, msg, job->saltlen + 4, u + i * hlen, NULL) == NULL)
+			job->rc = 0;
+		free(msg);
+	}
+
+	if (hlen == 32) {
+		sha256_mb_iterate(n, ipad, opad, u, c[0]->job->iterations - 1);
+	} else {
+		sha512_mb_iterate(n, ipad, opad, u, c[0]->job->iterations - 1);
+	}
+
+	for (i = 0; i < n; i++) {
+		struct pbkdf2_job *job = c[i]->job;
+		size_t off = (size_t)c[i]->block * hlen;
+		size_t len = job->keylen - off < (size_t)hlen ? job->keylen - off : (size_t)hlen;
+
+		memcpy(job->out + off, u + i * hlen, len);
+		c[i]->done = 1;
+	}
+
+	OPENSSL_cleanse(ipad, sizeof(ipad));
+	OPENSSL_cleanse(opad, sizeof(opad));
+	OPENSSL_cleanse(u, sizeof(u));
+}
+#endif /* MB_VECTORS */
+
+/*
+ * Derive keys for all `jobs'. Every output block of a job is a separate
+ * chain; chains with the same digest and iteration count share lanes.
+ */
+
+void pbkdf2_mb_run(struct pbkdf2_job **jobs, int njobs)
+{
+	struct chain *chains, *lane[MAXLANES];
+	int i, j, n, nchains = 0, lanes;
+
+	for (i = 0; i < njobs; i++) {
+		struct pbkdf2_job *job = jobs[i];
+
+		job->rc = 1;
+		if (pbkdf2_mb_lanes(job->md) > 1 && job->iterations >= 1 && job->keylen > 0)
+			nchains += (job->keylen + EVP_MD_size(job->md) - 1) / EVP_MD_size(job->md);
+		else
+			openssl_run(job);
+	}
+	if (nchains == 0)
+		return;
+
+	if ((chains = calloc(nchains, sizeof(struct chain))) == NULL) {
+		for (i = 0; i < njobs; i++) {
+			if (pbkdf2_mb_lanes(jobs[i]->md) > 1)
+				openssl_run(jobs[i]);
+		}
+		return;
+	}
+
+	for (i = 0, n = 0; i < njobs; i++) {
+		struct pbkdf2_job *job = jobs[i];
+		unsigned int b, nblocks;
+
+		if (pbkdf2_mb_lanes(job->md) == 1 || job->iterations < 1 || job->keylen == 0)
+			continue;
+		nblocks = (job->keylen + EVP_MD_size(job->md) - 1) / EVP_MD_size(job->md);
+		for (b = 0; b < nblocks; b++) {
+			chains[n].job = job;
+			chains[n].block = b;
+			n++;
+		}
+	}
+
+	for (i = 0; i < nchains; i++) {
+		const EVP_MD *md = chains[i].job->md;
+		int iterations = chains[i].job->iterations;
+
+		if (chains[i].done)
+			continue;
+
+		/* Gather chains which can run in lock-step with this one */
+		lanes = pbkdf2_mb_lanes(md);
+		n = 0;
+		for (j = i; j < nchains && n < lanes; j++) {
+			if (!chains[j].done && chains[j].job->iterations == iterations &&
+			    EVP_MD_size(chains[j].job->md) == EVP_MD_size(md)) {
+				lane[n++] = &chains[j];
+			}
+		}
+
+#ifdef MB_VECTORS
+		if (n == 1 && (chains[i].job->keylen + EVP_MD_size(md) - 1) / EVP_MD_size(md) == 1) {
+			/* A lone single-block job: vectors would only waste lanes */
+			openssl_run(chains[i].job);
+			chains[i].done = 1;
+		} else {
+			run_lanes(lane, n);
+		}
+#else
+		openssl_run(chains[i].job);
+		chains[i].done = 1;
+#endif
+	}
+
+	free(chains);
+}
+
+#if TEST
+int main()
+{
+	const EVP_MD *mds[] = { NULL, NULL, NULL };
+	static const size_t keylens[] = { 24, 32, 48, 64, 100, 130 };
+	static const int iters[] = { 1, 2, 901 };
+	struct pbkdf2_job jobs[200], *jp[200];
+	unsigned char ref[200];
+	char pw[200][160];
+	unsigned char salt[200][20];
+	int i, n = 0, bad = 0;
+
+	mds[0] = EVP_sha256();
+	mds[1] = EVP_sha512();
+	mds[2] = EVP_sha1();
+
+	for (i = 0; i < 200; i++) {
+		struct pbkdf2_job *job = &jobs[i];
+		int k;
+
+		/* short, block-sized and over-long passwords */
+		job->pwlen = (i * 7) % 150 + 1;
+		for (k = 0; k < (int)job->pwlen; k++)
+			pw[i][k] = 'a' + (i + k) % 26;
+		for (k = 0; k < 20; k++)
+			salt[i][k] = i * 31 + k;
+		job->password = pw[i];
+		job->salt = salt[i];
+		job->saltlen = 12 + i % 9;
+		job->md = mds[i % 3];
+		job->iterations = iters[(i / 3) % 3];
+		job->keylen = keylens[i % 6];
+		job->out = malloc(job->keylen);
+		jp[n++] = job;
+	}
+
+	pbkdf2_mb_run(jp, n);
+
+	for (i = 0; i < n; i++) {
+		PKCS5_PBKDF2_HMAC(jobs[i].password, jobs[i].pwlen, jobs[i].salt, jobs[i].saltlen,
+			jobs[i].iterations, jobs[i].md, jobs[i].keylen, ref);
+		if (jobs[i].rc != 1 || memcmp(ref, jobs[i].out, jobs[i].keylen) != 0) {
+			printf("job %d differs\n", i);
+			bad++;
+		}
+		free(jobs[i].out);
+	}
+	printf("lanes sha256=%d sha512=%d, %d/%d jobs bit-exact\n",
+		pbkdf2_mb_lanes(EVP_sha256()), pbkdf2_mb_lanes(EVP_sha512()), n - bad, n);
+	return bad != 0;
+}
+#endif
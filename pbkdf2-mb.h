@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2013 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <openssl/evp.h>
+
+#ifndef __PBKDF2_MB_H
+# define __PBKDF2_MB_H
+
+/*
+ * Multi-buffer PBKDF2-HMAC: independent derivations are run side by side
+ * in SIMD lanes, so a batch of N costs about N / lanes serial ones. Jobs
+ * using SHA-256 or SHA-512 are batched; anything else, and a lane group
+ * which would hold a single chain, goes to OpenSSL's PKCS5_PBKDF2_HMAC().
+ * The results are bit-exact with PKCS5_PBKDF2_HMAC().
+ */
+
+struct pbkdf2_job {
+	const char *password;
+	size_t pwlen;
+	const unsigned char *salt;
+	size_t saltlen;
+	int iterations;
+	const EVP_MD *md;
+	unsigned char *out;		/* keylen bytes, filled in */
+	size_t keylen;
+	int rc;				/* 1 on success */
+};
+
+int pbkdf2_mb_lanes(const EVP_MD *md);
+void pbkdf2_mb_run(struct pbkdf2_job **jobs, int njobs);
+
+#endif
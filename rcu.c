@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2014 Jan-Piet Mens <jp@mens.de>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of mosquitto nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "rcu.h"
+
+static _Atomic(struct rcu_head *) retired = NULL;
+
+/*
+ * Queue `head' to be freed once the broker thread next passes a quiescent
+ * state. May be called from any thread.
+ */
+
+void rcu_retire(struct rcu_head *head, void (*release)(struct rcu_head *head))
+{
+	struct rcu_head *old = atomic_load_explicit(&retired, memory_order_relaxed);
+
+	head->free = release;
+	do {
+		head->next = old;
+	} while (!atomic_compare_exchange_weak_explicit(&retired, &old, head,
+			memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * Called by the broker thread between callbacks only.
+ */
+
+void rcu_quiescent(void)
+{
+	struct rcu_head *head, *next;
+
+	if (atomic_load_explicit(&retired, memory_order_relaxed) == NULL)
+		return;
+
+	head = atomic_exchange_explicit(&retired, NULL, memory_order_acquire);
+	for (; head != NULL; head = next) {
+		next = head->next;
+		head->free(head);
+	}
+}
@@ -34,10 +34,25 @@
 #ifndef __USERDATA_H
 # define _USERDATA_H
 
+/*
+ * Subscription filter on which the client's rule set was shown to grant
+ * READ for every topic it can match; deliveries below it skip the ACL check.
+ */
+
+struct provenfilter {
+	struct provenfilter *next;
+	char *filter;
+	time_t expire_time;
+};
+
+#define MAXPROVEN	(32)	/* per client */
+
 struct cliententry {
 	void *key;
 	char *username;
 	char *clientid;
+	struct provenfilter *proven;
+	int nproven;
 	UT_hash_handle hh;
 };
 
@@ -49,10 +64,12 @@ struct userdata {
 	time_t acl_cacheseconds;		/* number of seconds to cache ACL lookups */
 	time_t acl_cachejitter;		/* number of seconds to add/remove to cache ACL lookups TTL */
 	struct cacheentry *aclcache;
+	struct rulecacheentry *rulecache;	/* filter-scoped ACL grants */
 	time_t auth_cacheseconds;		/* number of seconds to cache AUTH lookups */
 	time_t auth_cachejitter;		/* number of seconds to add/remove to cache AUTH lookups TTL */
 	struct cacheentry *authcache;
 	struct cliententry *clients;
+	struct arena *arena;		/* transient allocations of one call */
 };
 
 #endif